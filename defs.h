@@ -6,11 +6,15 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct proc_priority;
+struct timeout;
+struct sched_attr;
 struct stat;
 struct superblock;
 struct cache_info;
 struct list_head;
 struct filesystem;
+struct mm_struct;
 
 // bio.c
 void            binit(void);
@@ -32,7 +36,7 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, char*, int n);
+int             fileread(struct file*, char*, int n, int timeout);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
@@ -74,9 +78,17 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+void            kref(char*);
+int             krefs(char*);
+char*           alloc_pages(int);
+void            free_pages(char*, int);
+int             buddyinfo(uint*);
+char*           kalloc_zeroed(void);
+void            zeroinit(void);
+void            zeropoolinfo(uint*, uint*, uint*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
-extern int      free_pages_count;
+extern volatile uint free_pages_count;
 
 // kbd.c
 void            kbdintr(void);
@@ -86,6 +98,7 @@ int             cpunum(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(uchar, int);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
@@ -108,7 +121,7 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, char*, int);
+int             piperead(struct pipe*, char*, int, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
@@ -118,7 +131,8 @@ void            exit(void);
 void            exit_group(void);
 void            kill_other_threads_in_group(void);
 int             fork(void);
-int             clone(void*, unsigned int);
+int             clone(void*, unsigned int, uint, uint);
+int             spawn(int (*)(void*), void*);
 int             growproc(int);
 int             kill(int);
 void            pinit(void);
@@ -126,16 +140,32 @@ void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+int             sleep_timeout(void*, struct spinlock*, uint);
 void            userinit(void);
+void            vfork_release(void);
 int             wait(void);
 void            wakeup(void*);
+int             wakeup_n(void*, int);
 void            yield(void);
 struct mm_struct* get_empty_mm(void);
 void            free_mm(struct mm_struct*);
 struct proc*    get_proc_by_pid(int);
+int             proc_memory(int, uint*, uint*);
+int             proc_priority(int, struct proc_priority*);
+struct mm_struct* replace_mm(struct proc*, struct mm_struct*);
 void*           mmap(void*, int, int, int, struct file*, int);
 int             handle_pagefault(uint, uint);
 void            free_mmaps(struct mm_struct* mm);
+struct proc*    kthread_create(char*, void (*)(void));
+int             sched_tick(void);
+extern int      sched_group_by_uid;
+int             sched_setattr(int, struct sched_attr*);
+int             sched_getattr(int, struct sched_attr*);
+int             sched_setaffinity(int, uint);
+int             sched_getaffinity(int, uint*);
+int             getpriority(int, int, int*);
+int             setpriority(int, int, int);
+void            reaperinit(void);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -167,9 +197,26 @@ int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
 
+// textcache.c
+void            textinit(void);
+char*           textpage(struct inode*, uint);
+void            textinval(struct inode*);
+
 // timer.c
 void            timerinit(void);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint, int, int);
+int             futex_wake(uint, int);
+
+// timeout.c
+void            timeoutinit(void);
+void            timeout_init(struct timeout*, void (*)(void*), void*);
+void            timeout_add(struct timeout*, uint);
+int             timeout_del(struct timeout*);
+void            timeout_run(void);
+
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
@@ -192,7 +239,12 @@ int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, int);
+int             cowpage(pde_t*, uint);
+int             pagein(struct mm_struct*, uint);
+int             pagein_range(struct mm_struct*, uint, uint);
+uint            uvmrss(pde_t*, uint);
+int             unsharecow(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -207,6 +259,8 @@ void            init_caches(void);
 struct cache_info* kmem_cache_create(unsigned int size);
 void*           kmem_cache_alloc(struct cache_info*);
 void            kmem_cache_free(void* mem);
+void*           kmalloc(unsigned int size, int flags);
+void            kmfree(void*);
 
 // list.c
 
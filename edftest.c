@@ -0,0 +1,151 @@
+// Count missed deadlines of a periodic job while CPU hogs
+// run in the background, first as a normal process and then
+// as a SCHED_DEADLINE one.  Also check admission control.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "errno.h"
+#include "sched.h"
+
+#define NHOGS    8
+#define NJOBS    50
+#define RUNTIME  2
+#define DEADLINE 5
+#define PERIOD   10
+
+int hogs[NHOGS];
+
+void
+start_hogs(void)
+{
+  for(int i = 0; i < NHOGS; i++){
+    hogs[i] = fork();
+    if(hogs[i] < 0){
+      printf(2, "edftest: fork failed\n");
+      exit();
+    }
+    if(hogs[i] == 0){
+      for(;;)
+        ;
+    }
+  }
+}
+
+void
+stop_hogs(void)
+{
+  for(int i = 0; i < NHOGS; i++)
+    kill(hogs[i]);
+  for(int i = 0; i < NHOGS; i++)
+    wait();
+}
+
+// A little work, well within RUNTIME ticks.
+void
+job(void)
+{
+  volatile int x = 0;
+  for(int i = 0; i < 10000; i++)
+    x += i;
+}
+
+// Job k is released at start + k * PERIOD and must be
+// done DEADLINE ticks later.
+int
+run_normal(void)
+{
+  int missed = 0;
+  int start = uptime();
+  for(int k = 0; k < NJOBS; k++){
+    int release = start + k * PERIOD;
+    int now = uptime();
+    if(now < release)
+      sleep(release - now);
+    job();
+    if(uptime() > release + DEADLINE)
+      missed++;
+  }
+  return missed;
+}
+
+int
+run_deadline(void)
+{
+  struct sched_attr attr;
+  int missed = 0;
+
+  attr.sched_policy = SCHED_DEADLINE;
+  attr.sched_runtime = RUNTIME;
+  attr.sched_deadline = DEADLINE;
+  attr.sched_period = PERIOD;
+  if(sched_setattr(0, &attr) < 0){
+    printf(2, "edftest: sched_setattr failed, errno %d\n", errno);
+    return -1;
+  }
+  int start = uptime();
+  for(int k = 0; k < NJOBS; k++){
+    job();
+    if(uptime() > start + k * PERIOD + DEADLINE)
+      missed++;
+    // Done until the next period.
+    sched_yield();
+  }
+  attr.sched_policy = SCHED_NORMAL;
+  sched_setattr(0, &attr);
+  return missed;
+}
+
+// Asking for the whole of a CPU must be refused,
+// and must leave the old parameters in place.
+int
+check_admission(void)
+{
+  struct sched_attr attr;
+
+  attr.sched_policy = SCHED_DEADLINE;
+  attr.sched_runtime = RUNTIME;
+  attr.sched_deadline = DEADLINE;
+  attr.sched_period = PERIOD;
+  if(sched_setattr(0, &attr) < 0){
+    printf(2, "edftest: sched_setattr failed, errno %d\n", errno);
+    return -1;
+  }
+  attr.sched_runtime = PERIOD;
+  attr.sched_deadline = PERIOD;
+  if(sched_setattr(0, &attr) == 0 || errno != EBUSY){
+    printf(2, "edftest: over-subscription was not refused\n");
+    return -1;
+  }
+  if(sched_getattr(0, &attr) < 0 ||
+     attr.sched_policy != SCHED_DEADLINE ||
+     attr.sched_runtime != RUNTIME){
+    printf(2, "edftest: parameters lost after refused sched_setattr\n");
+    return -1;
+  }
+  attr.sched_policy = SCHED_NORMAL;
+  sched_setattr(0, &attr);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf(1, "edftest: %d jobs of %d/%d/%d ticks, %d hogs\n",
+         NJOBS, RUNTIME, DEADLINE, PERIOD, NHOGS);
+  if(check_admission() < 0){
+    printf(1, "edftest: FAILED\n");
+    exit();
+  }
+  start_hogs();
+  int normal = run_normal();
+  int deadline = run_deadline();
+  stop_hogs();
+  printf(1, "normal: %d/%d deadlines missed\n", normal, NJOBS);
+  printf(1, "deadline: %d/%d deadlines missed\n", deadline, NJOBS);
+  if(deadline != 0)
+    printf(1, "edftest: FAILED\n");
+  else
+    printf(1, "edftest: ok\n");
+  exit();
+}
@@ -11,6 +11,9 @@
 #include "stat.h"
 #include "errno.h"
 #include "err.h"
+#include "tls.h"
+
+#define SHEBANGMAX 256  // Longest "#!" line, after the "#!"
 
 static int _exec(char* path, char **argv, char **envp, int current_depth);
 
@@ -25,10 +28,13 @@ _exec(char *path, char **argv, char **envp, int current_depth)
 {
   char *s, *last;
   int i, j, off, st, linelen;
-  uint argc, sz, sp, ustack[4+MAXARG+1+MAXARG+1];
+  uint argc, sz, sp, tlsend, ustack[4+MAXARG+1+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
-  struct proghdr ph;
+  struct inode *ip, *exe;
+  struct proghdr ph, tlsph;
+  struct mm_region region[NREGION], *r;
+  int nregion;
+  struct tls_tcb tcb;
   pde_t *pgdir;
   char* args[MAXARG + 3];
   char* progpath;
@@ -44,6 +50,7 @@ _exec(char *path, char **argv, char **envp, int current_depth)
     return -EACCES;
   }
   pgdir = 0;
+  exe = 0;
 
   // Check for shebang
   if(readi(ip, tmp, 0, 2) < sizeof(tmp)) {
@@ -51,8 +58,11 @@ _exec(char *path, char **argv, char **envp, int current_depth)
     goto bad;
   }
   if(tmp[0] == '#' && tmp[1] == '!'){
-    progpath = kalloc();
-    i = readi(ip, progpath, 2, PGSIZE);
+    if((progpath = kmalloc(SHEBANGMAX, 0)) == 0){
+      st = -ENOMEM;
+      goto bad;
+    }
+    i = readi(ip, progpath, 2, SHEBANGMAX);
     iunlockput(ip);
     ip = 0;
     for(j = 0; j < i && progpath[j] == ' '; ++j)
@@ -61,7 +71,7 @@ _exec(char *path, char **argv, char **envp, int current_depth)
     for(; j < i && progpath[j] != ' ' &&
         progpath[j] != '\t' && progpath[j] != '\n'; ++j)
       ;
-    if(j == PGSIZE){
+    if(j == SHEBANGMAX){
       st = -E2BIG;
       goto exit;
     }
@@ -89,7 +99,7 @@ _exec(char *path, char **argv, char **envp, int current_depth)
     args[++argc] = 0;
     st = _exec(args[0], args, envp, current_depth);
 exit:
-    kfree(progpath);
+    kmfree(progpath);
     return st;
   }
   // Check ELF header
@@ -107,28 +117,71 @@ exit:
     goto bad;
   }
 
-  // Load program into memory.
+  // The program is not read in here: its segments become regions
+  // of the new mm, whose pages are read from the file on first
+  // touch, see pagein().
   sz = 0;
+  nregion = 0;
+  memset(&tlsph, 0, sizeof(tlsph));
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph)) {
       st = -EIO;
       goto bad;
     }
-    if(ph.type != ELF_PROG_LOAD)
+    if(ph.type == ELF_PROG_TLS)
+      tlsph = ph;
+    if(ph.type != ELF_PROG_LOAD || ph.memsz == 0)
       continue;
     if(ph.memsz < ph.filesz) {
       st = -E2BIG;
       goto bad;
     }
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz, PTE_W | PTE_U)) == 0) {
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE) {
       st = -ENOMEM;
       goto bad;
     }
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0) {
-      st = -ENOMEM;
+    if(nregion == NREGION) {
+      st = -ENOEXEC;
       goto bad;
     }
+    r = &region[nregion++];
+    r->start = PGROUNDDOWN(ph.vaddr);
+    r->end = PGROUNDUP(ph.vaddr + ph.memsz);
+    r->vaddr = ph.vaddr;
+    r->off = ph.off;
+    r->filesz = ph.filesz;
+    r->perm = PTE_U;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      r->perm |= PTE_W;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
+  }
+
+  // Thread-local storage of the first thread, on its own pages
+  // after the program: a copy of the TLS segment and then the
+  // thread control block.  See tls.h.
+  tcb.align = tlsph.align < sizeof(uint) ? sizeof(uint) : tlsph.align;
+  if(tlsph.memsz < tlsph.filesz || tcb.align > PGSIZE ||
+     (tcb.align & (tcb.align - 1))) {
+    st = -ENOEXEC;
+    goto bad;
+  }
+  tcb.size = (tlsph.memsz + tcb.align - 1) & ~(tcb.align - 1);
+  tcb.image = tlsph.vaddr;
+  tcb.filesz = tlsph.filesz;
+  sz = PGROUNDUP(sz);
+  tcb.self = (struct tls_tcb*)(sz + tcb.size);
+  if((tlsend = allocuvm(pgdir, sz, (uint)tcb.self + sizeof(tcb),
+                        PTE_W | PTE_U)) == 0) {
+    st = -ENOMEM;
+    goto bad;
+  }
+  if(loaduvm(pgdir, (char*)sz, ip, tlsph.off, tlsph.filesz) < 0 ||
+     copyout(pgdir, (uint)tcb.self, &tcb, sizeof(tcb)) < 0) {
+    st = -ENOMEM;
+    goto bad;
   }
+  sz = tlsend;
   int new_euid = proc->euid;
   int new_egid = proc->egid;
   if((ip->mode & S_ISUID) == S_ISUID){
@@ -137,6 +190,7 @@ exit:
   if((ip->mode & S_ISGID) == S_ISGID){
     new_egid = ip->gid;
   }
+  exe = idup(ip);
   iunlockput(ip);
   ip = 0;
 
@@ -209,19 +263,26 @@ exit:
   kill_other_threads_in_group();
   proc->group_leader = proc;
   proc->tgid = proc->pid;
-  struct mm_struct* old_mm = proc->mm;
-  proc->mm = kmem_cache_alloc(mm_cache);
-  initlock(&proc->mm->lock, "proc->mm");
-  initlock(&proc->mm->mmap_list_lock, "proc->mmap_list");
-  proc->mm->users = 1;
-  proc->mm->pgdir = pgdir;
-  proc->mm->sz = sz;
-  INIT_LIST_HEAD(&proc->mm->mmap_list);
+  struct mm_struct* mm = kmem_cache_alloc(mm_cache);
+  initlock(&mm->lock, "proc->mm");
+  initlock(&mm->mmap_list_lock, "proc->mmap_list");
+  mm->users = 1;
+  mm->pgdir = pgdir;
+  mm->sz = sz;
+  mm->exe = exe;
+  mm->nregion = nregion;
+  memmove(mm->region, region, sizeof(region));
+  INIT_LIST_HEAD(&mm->mmap_list);
+  struct mm_struct* old_mm = replace_mm(proc, mm);
   proc->tf->eip = elf.entry;  // main
   proc->tf->esp = sp;
+  proc->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+  proc->tls = (uint)tcb.self;
+  proc->clear_child_tid = 0;
   switchuvm(proc);
   free_mmaps(old_mm);
   free_mm(old_mm);
+  vfork_release();
   return 0;
 
  bad:
@@ -229,5 +290,7 @@ exit:
     freevm(pgdir);
   if(ip)
     iunlockput(ip);
+  if(exe)
+    iput(exe);
   return st;
 }
@@ -126,15 +126,17 @@ filestat(struct file *f, struct stat *st)
 }
 
 // Read from file f.
+// Reads from pipes give up after timeout ticks without data,
+// unless timeout is 0.
 int
-fileread(struct file *f, char *addr, int n)
+fileread(struct file *f, char *addr, int n, int timeout)
 {
   int r;
 
   if(f->readable == 0)
     return -EBADF;
   if(f->type == FD_PIPE || f->type == FD_FIFO)
-    return piperead(f->pipe, addr, n);
+    return piperead(f->pipe, addr, n, timeout);
   if(f->type == FD_INODE){
     ilock(f->ip);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
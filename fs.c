@@ -541,6 +541,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  textinval(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->fs->dev, ip->addrs[i]);
@@ -652,6 +654,7 @@ _writei(struct inode *ip, char *src, uint off, uint n)
 int
 writei(struct inode *ip, char *dst, uint off, uint n)
 {
+  textinval(ip);
   if (ip->ops.write == 0) {
     return _writei(ip, dst, off, n);
   } else {
@@ -668,13 +671,17 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entries _dirlookup() reads at once, on the kernel stack.
+#define NDIRBATCH 8
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 _dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct dirent de;
+  int i, n;
+  struct dirent de[NDIRBATCH];
 
   if(!S_ISDIR(dp->mode))
     panic("dirlookup not DIR");
@@ -683,17 +690,21 @@ _dirlookup(struct inode *dp, char *name, uint *poff)
     return ERR_PTR(-EPERM);
   }
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->fs, inum);
+  // Read several entries at a time rather than one per readi().
+  for(off = 0; off < dp->size; off += n){
+    n = readi(dp, (char*)de, off, sizeof(de));
+    if(n <= 0 || n % sizeof(de[0]) != 0)
+      panic("dirlookup read");
+    for(i = 0; i < n / sizeof(de[0]); i++){
+      if(de[i].inum == 0)
+        continue;
+      if(namecmp(name, de[i].name) == 0){
+        // entry matches path element
+        if(poff)
+          *poff = off + i*sizeof(de[0]);
+        inum = de[i].inum;
+        return iget(dp->fs, inum);
+      }
     }
   }
 
@@ -0,0 +1,105 @@
+// Futexes: sleeping on a word of user memory.
+//
+// FUTEX_WAIT sleeps as long as the word holds the value the caller
+// expects, FUTEX_WAKE wakes up those sleeping on it.  Waiters are
+// keyed by the physical address of the word, so CLONE_VM threads as
+// well as processes sharing a MAP_SHARED mapping meet on the same
+// key.  The key is also the sleep channel: physical addresses are
+// below KERNBASE, so they can't be mistaken for the kernel addresses
+// other sleepers use.
+//
+// A hashed lock is held from checking the word to going to sleep,
+// and by wakers, so a change of the word followed by FUTEX_WAKE
+// can't slip in between.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "errno.h"
+
+#define NFUTEXLOCK 64
+
+static struct spinlock futex_locks[NFUTEXLOCK];
+
+void
+futexinit(void)
+{
+  for (int i = 0; i < NFUTEXLOCK; ++i) {
+    initlock(&futex_locks[i], "futex");
+  }
+}
+
+// Find the physical address of the int at user address addr.
+static int
+futex_key(uint addr, uint* key)
+{
+  pde_t* pde;
+  pte_t* pte;
+
+  if (addr % sizeof(int) != 0)
+    return -EINVAL;
+  if (addr >= proc->mm->sz || pagein_range(proc->mm, addr, sizeof(int)) < 0)
+    return -EFAULT;
+  pde = &proc->mm->pgdir[PDX(addr)];
+  if (!(*pde & PTE_P))
+    return -EFAULT;
+  pte = (pte_t*)p2v(PTE_ADDR(*pde)) + PTX(addr);
+  if ((*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+    return -EFAULT;
+  *key = PTE_ADDR(*pte) | (addr & (PGSIZE - 1));
+  return 0;
+}
+
+static struct spinlock*
+futex_lock(uint key)
+{
+  return &futex_locks[(key / sizeof(int)) % NFUTEXLOCK];
+}
+
+// Sleep on addr if it holds val, for at most timeout ticks
+// unless timeout is 0.
+int
+futex_wait(uint addr, int val, int timeout)
+{
+  uint key;
+  int err;
+
+  if ((err = futex_key(addr, &key)) < 0)
+    return err;
+  struct spinlock* lk = futex_lock(key);
+  acquire(lk);
+  if (*(int*)p2v(key) != val) {
+    release(lk);
+    return -EAGAIN;
+  }
+  if (timeout > 0) {
+    err = sleep_timeout((void*)key, lk, timeout);
+  } else {
+    sleep((void*)key, lk);
+  }
+  release(lk);
+  if (proc->killed)
+    return -EINTR;
+  return err;
+}
+
+// Wake up at most n processes sleeping on addr.
+// Returns how many were woken up.
+int
+futex_wake(uint addr, int n)
+{
+  uint key;
+  int err;
+
+  if ((err = futex_key(addr, &key)) < 0)
+    return err;
+  struct spinlock* lk = futex_lock(key);
+  acquire(lk);
+  int woken = wakeup_n((void*)key, n);
+  release(lk);
+  return woken;
+}
@@ -0,0 +1,5 @@
+/*
+ * futex operations:
+ */
+#define FUTEX_WAIT 0 /* sleep if *addr == val, at most timeout ticks if not 0 */
+#define FUTEX_WAKE 1 /* wake up at most val waiters on addr */
@@ -3,25 +3,72 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "threadpool.h"
 
-char buf[1024];
 int match(char*, char*);
 
+// Matching lines of one file.  Files are searched in parallel, so
+// the lines are kept in memory to be printed in order afterwards.
+struct result {
+  char *name;
+  int error;   // ERR_OPEN or ERR_NOMEM if the search failed
+  char *lines;
+  int len, cap;
+};
+
+#define ERR_OPEN  1  // The file couldn't be opened
+#define ERR_NOMEM 2  // The lines didn't fit in memory
+
+// Print a matching line, or keep it in r if there is one.
+// If there is no room for it, r->error says so; printing it
+// here would put it ahead of the lines of earlier files.
+void
+emit(struct result *r, char *p, int n)
+{
+  if(r && r->error)
+    return;
+  if(r && r->len + n > r->cap){
+    int cap = r->cap ? 2*r->cap : 256;
+    char *lines;
+    while(cap < r->len + n)
+      cap *= 2;
+    if((lines = malloc(cap)) != 0){
+      memmove(lines, r->lines, r->len);
+      free(r->lines);
+      r->lines = lines;
+      r->cap = cap;
+    }
+  }
+  if(r == 0){
+    write(1, p, n);
+    return;
+  }
+  if(r->len + n > r->cap){
+    r->error = ERR_NOMEM;
+    return;
+  }
+  memmove(r->lines + r->len, p, n);
+  r->len += n;
+}
+
 void
-grep(char *pattern, int fd)
+grep(char *pattern, int fd, struct result *r)
 {
+  char buf[1024];
   int n, m;
   char *p, *q;
   
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m)) > 0){
+  while((r == 0 || !r->error) &&
+        (n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
     m += n;
+    buf[m] = '\0';
     p = buf;
     while((q = strchr(p, '\n')) != 0){
       *q = 0;
       if(match(pattern, p)){
         *q = '\n';
-        write(1, p, q+1 - p);
+        emit(r, p, q+1 - p);
       }
       p = q+1;
     }
@@ -34,30 +81,68 @@ grep(char *pattern, int fd)
   }
 }
 
+struct search {
+  char *pattern;
+  struct result *results;
+};
+
+// Search files lo to hi-1, for the thread pool.
+void
+grep_files(int lo, int hi, void *arg)
+{
+  struct search *s = arg;
+  int fd;
+
+  for(int i = lo; i < hi; i++){
+    struct result *r = &s->results[i];
+    if((fd = open(r->name, 0)) < 0){
+      r->error = ERR_OPEN;
+      continue;
+    }
+    grep(s->pattern, fd, r);
+    close(fd);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
-  char *pattern;
+  int i, n;
+  struct search s;
   
   if(argc <= 1){
     printf(2, "usage: grep pattern [file ...]\n");
     exit();
   }
-  pattern = argv[1];
+  s.pattern = argv[1];
   
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(s.pattern, 0, 0);
     exit();
   }
 
+  if((s.results = malloc(argc * sizeof(struct result))) == 0){
+    printf(1, "grep: out of memory\n");
+    exit();
+  }
+  memset(s.results, 0, argc * sizeof(struct result));
+  for(i = 2; i < argc; i++)
+    s.results[i].name = argv[i];
+  n = pool_ncpu();
+  pool_start(argc - 2 < n ? argc - 2 : n);
+  parallel_for(2, argc, 1, grep_files, &s);
+  pool_stop();
+
   for(i = 2; i < argc; i++){
-    if((fd = open(argv[i], 0)) < 0){
+    write(1, s.results[i].lines, s.results[i].len);
+    if(s.results[i].error == ERR_OPEN){
       printf(1, "grep: cannot open %s\n", argv[i]);
       exit();
     }
-    grep(pattern, fd);
-    close(fd);
+    if(s.results[i].error == ERR_NOMEM){
+      printf(1, "grep: out of memory searching %s\n", argv[i]);
+      exit();
+    }
   }
   exit();
 }
@@ -1,38 +1,100 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, and runs of
+// 2^order physically contiguous ones with alloc_pages().
+//
+// Free memory is kept by a buddy allocator: in blocks of 2^order
+// pages, aligned to their size, one free list per order.  A block
+// is split in halves to serve smaller requests, and a freed block
+// is merged with its buddy, the other half of the block they were
+// split from, whenever that is free as well.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
+#include "proc.h"
 #include "spinlock.h"
+#include "list.h"
+#include "resource.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
 
-int free_pages_count = 0;
+// Free pages, counting those cached by the CPUs.  Updated with
+// atomic adds, so it can be read without a lock.
+volatile uint free_pages_count = 0;
+
+#define MAGSIZE  32 // Free pages a CPU keeps for itself at most
+#define MAGBATCH 16 // Pages moved to or from the buddy lists at once
+
+#define NPAGE (PHYSTOP / PGSIZE)
 
 struct run {
-  struct run *next;
+  struct run *next;       // In a magazine
+  struct list_head list;  // In a buddy free list
+};
+
+// A CPU's own cache of free pages, so that most kalloc() and
+// kfree() calls don't touch the global list.  Only its CPU uses
+// it, except when another runs out of pages altogether and takes
+// some; the lock is there for that case.
+struct magazine {
+  struct spinlock lock;
+  struct run *list;
+  int n;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct list_head free[MAXORDER + 1];  // Free blocks of each order
+  uint nfree[MAXORDER + 1];
+  // For each page that starts a free block, the block's order
+  // plus one; 0 for all other pages.
+  uchar order[NPAGE];
+  struct magazine mag[NCPU];
+  // References to each page of physical memory, for pages shared
+  // copy-on-write after fork.  kalloc() hands out pages with one
+  // reference, kfree() drops one and frees the page on the last.
+  volatile uint refs[NPAGE];
 } kmem;
 
+// Pages zeroed ahead of time by the kzerod kernel thread, when its
+// CPU has nothing else to do, for kalloc_zeroed() to hand out.
+// They count as free, and kalloc() takes them too once there is
+// nothing else left.
+struct {
+  struct spinlock lock;
+  struct run *list;  // Linked through the first word of each page
+  int n;
+} zpool;
+
+// kalloc_zeroed() calls served from the pool, and those that had
+// to zero a page themselves.
+volatile uint zero_hits, zero_misses;
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until then there are no magazines: pages go straight to the
+// buddy lists.
 void
 kinit1(void *vstart, void *vend)
 {
+  struct magazine *m;
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&zpool.lock, "zpool");
+  for(i = 0; i <= MAXORDER; i++)
+    INIT_LIST_HEAD(&kmem.free[i]);
+  for(m = kmem.mag; m < kmem.mag + NCPU; m++)
+    initlock(&m->lock, "kmag");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -49,34 +111,219 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    kmem.refs[v2p(p) / PGSIZE] = 1;
     kfree(p);
+  }
+}
+
+static struct run*
+pagerun(uint pn)
+{
+  return (struct run*)p2v(pn * PGSIZE);
+}
+
+static void
+addfree(uint pn, int order)
+{
+  kmem.order[pn] = order + 1;
+  list_add(&pagerun(pn)->list, &kmem.free[order]);
+  kmem.nfree[order]++;
+}
+
+static void
+delfree(uint pn, int order)
+{
+  kmem.order[pn] = 0;
+  list_del(&pagerun(pn)->list);
+  kmem.nfree[order]--;
+}
+
+// Give the block of 2^order pages from page number pn back to the
+// buddy lists, merging it with its buddy for as long as that is
+// free too.  Caller holds kmem.lock.
+static void
+buddy_free(uint pn, int order)
+{
+  uint buddy;
+
+  for(; order < MAXORDER; order++){
+    buddy = pn ^ (1 << order);
+    if(buddy >= NPAGE || kmem.order[buddy] != order + 1)
+      break;
+    delfree(buddy, order);
+    pn &= ~(1 << order);
+  }
+  addfree(pn, order);
+}
+
+// Take a block of 2^order pages off the buddy lists, splitting a
+// larger one if there is none that size; the halves not used go
+// back on the lists.  Caller holds kmem.lock.
+static struct run*
+buddy_alloc(int order)
+{
+  struct run *r;
+  uint pn;
+  int k;
+
+  for(k = order; k <= MAXORDER && list_empty(&kmem.free[k]); k++)
+    ;
+  if(k > MAXORDER)
+    return 0;
+  r = list_entry(kmem.free[k].next, struct run, list);
+  pn = v2p(r) / PGSIZE;
+  delfree(pn, k);
+  while(k > order){
+    k--;
+    addfree(pn + (1 << k), k);
+  }
+  return r;
+}
+
+// This CPU's magazine, locked.
+static struct magazine*
+mymag(void)
+{
+  struct magazine *m;
+
+  pushcli();
+  m = &kmem.mag[cpu - cpus];
+  acquire(&m->lock);
+  popcli();
+  return m;
+}
+
+// Move n pages from locked m to the buddy lists.
+static void
+drain(struct magazine *m, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0 && (r = m->list) != 0){
+    m->list = r->next;
+    m->n--;
+    buddy_free(v2p(r) / PGSIZE, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Move up to n pages from the buddy lists to locked m.
+static void
+refill(struct magazine *m, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0 && (r = buddy_alloc(0)) != 0){
+    r->next = m->list;
+    m->list = r;
+    m->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Empty every CPU's magazine, so that the pages in them can be
+// merged into larger blocks.
+static void
+drain_all(void)
+{
+  struct magazine *m;
+
+  for(m = kmem.mag; m < kmem.mag + NCPU; m++){
+    acquire(&m->lock);
+    drain(m, m->n);
+    release(&m->lock);
+  }
+}
+
+// Take a page from another CPU's magazine, when the buddy lists
+// are empty.  Without this, pages freed on other CPUs would be out
+// of reach.
+static struct run*
+steal(void)
+{
+  struct magazine *m;
+  struct run *r;
+
+  for(m = kmem.mag; m < kmem.mag + NCPU; m++){
+    acquire(&m->lock);
+    if((r = m->list) != 0){
+      m->list = r->next;
+      m->n--;
+      release(&m->lock);
+      return r;
+    }
+    release(&m->lock);
+  }
+  return 0;
+}
+
+// Take a page from the zeroed pool, with its link word cleared,
+// or return 0 if the pool is empty.
+static struct run*
+zpool_take(void)
+{
+  struct run *r;
+  int n;
+
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.n--;
+  }
+  n = zpool.n;
+  release(&zpool.lock);
+  if(r == 0)
+    return 0;
+  r->next = 0;
+  // Let kzerod know once the pool is half empty.
+  if(n == NZEROPAGE / 2)
+    wakeup(&zpool);
+  return r;
 }
 
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if it was the last one.
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(char *v)
 {
+  struct magazine *m;
   struct run *r;
-  free_pages_count++;
+  uint refs;
 
   if((uint)v % PGSIZE || v < end || v2p(v) >= PHYSTOP)
     panic("kfree");
 
+  refs = fetch_add(&kmem.refs[v2p(v) / PGSIZE], -1);
+  if(refs == 0)
+    panic("kfree: free page");
+  if(refs > 1)
+    return;
+
+#ifdef DEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  atomic_add(&free_pages_count, 1);
+  if(!kmem.use_lock){
+    buddy_free(v2p(v) / PGSIZE, 0);
+    return;
+  }
+  m = mymag();
+  if(m->n >= MAGSIZE)
+    drain(m, MAGBATCH);
+  r->next = m->list;
+  m->list = r;
+  m->n++;
+  release(&m->lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -85,17 +332,211 @@ kfree(char *v)
 char*
 kalloc(void)
 {
+  struct magazine *m;
   struct run *r;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r) {
-    kmem.freelist = r->next;
-    free_pages_count--;
+  if(!kmem.use_lock){
+    r = buddy_alloc(0);
+  } else {
+    m = mymag();
+    if(m->list == 0)
+      refill(m, MAGBATCH);
+    if((r = m->list) != 0){
+      m->list = r->next;
+      m->n--;
+    }
+    release(&m->lock);
+    if(r == 0)
+      r = steal();
+    if(r == 0)
+      r = zpool_take();
+  }
+  if(r){
+    atomic_add(&free_pages_count, -1);
+    kmem.refs[v2p(r) / PGSIZE] = 1;
+  }
+  return (char*)r;
+}
+
+// Allocate a page of physical memory filled with zeroes, from the
+// pool kzerod keeps if it can.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+  char *v;
+
+  if(kmem.use_lock && (r = zpool_take()) != 0){
+    atomic_add(&free_pages_count, -1);
+    kmem.refs[v2p(r) / PGSIZE] = 1;
+    atomic_add(&zero_hits, 1);
+    return (char*)r;
   }
-  if(kmem.use_lock)
+  if((v = kalloc()) == 0)
+    return 0;
+  memset(v, 0, PGSIZE);
+  atomic_add(&zero_misses, 1);
+  return v;
+}
+
+// Is another process waiting for this CPU?
+static int
+cpu_wanted(void)
+{
+  int n;
+
+  pushcli();
+  n = cpu->rq.nr_running;
+  popcli();
+  return n > 0;
+}
+
+// Keep the pool of zeroed pages full, with CPU time no one else
+// wants: kzerod gives way for a tick as soon as another process
+// is waiting to run, rather than finishing the page after next.
+static void
+kzerod(void)
+{
+  struct run *r;
+
+  // Still holding cpu->rq.lock from scheduler.
+  release(&cpu->rq.lock);
+
+  acquire(&zpool.lock);
+  for(;;){
+    if(zpool.n >= NZEROPAGE){
+      sleep(&zpool, &zpool.lock);
+      continue;
+    }
+    if(cpu_wanted()){
+      sleep_timeout(&zpool, &zpool.lock, 1);
+      continue;
+    }
+    release(&zpool.lock);
+    if((r = (struct run*)kalloc()) == 0){
+      // Out of memory; the pool would only be taken back.
+      acquire(&zpool.lock);
+      sleep_timeout(&zpool, &zpool.lock, 100);
+      continue;
+    }
+    memset(r, 0, PGSIZE);
+    kmem.refs[v2p(r) / PGSIZE] = 0;
+    atomic_add(&free_pages_count, 1);
+    acquire(&zpool.lock);
+    r->next = zpool.list;
+    zpool.list = r;
+    zpool.n++;
+  }
+}
+
+void
+zeroinit(void)
+{
+  struct proc *p;
+
+  if((p = kthread_create("kzerod", kzerod)) == 0)
+    panic("zeroinit");
+  p->nice = PRIO_MAX;
+}
+
+// Take another reference to a page returned by kalloc().
+void
+kref(char *v)
+{
+  atomic_add(&kmem.refs[v2p(v) / PGSIZE], 1);
+}
+
+// Number of references to a page returned by kalloc().
+int
+krefs(char *v)
+{
+  return kmem.refs[v2p(v) / PGSIZE];
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their
+// size.  Returns 0 if there is no free block that large.  Each
+// page has one reference; give them back with free_pages().
+char*
+alloc_pages(int order)
+{
+  struct run *r;
+  uint pn, i;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&kmem.lock);
+  r = buddy_alloc(order);
+  release(&kmem.lock);
+  if(r == 0){
+    // The missing buddies may be sitting in magazines.
+    drain_all();
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
     release(&kmem.lock);
+    if(r == 0)
+      return 0;
+  }
+  atomic_add(&free_pages_count, -(1 << order));
+  pn = v2p(r) / PGSIZE;
+  for(i = 0; i < 1 << order; i++)
+    kmem.refs[pn + i] = 1;
   return (char*)r;
 }
 
+// Free the 2^order pages at v returned by alloc_pages(order).
+void
+free_pages(char *v, int order)
+{
+  uint pn, i;
+
+  if(order == 0){
+    kfree(v);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || (uint)v % (PGSIZE << order) ||
+     v < end || v2p(v) + (PGSIZE << order) > PHYSTOP)
+    panic("free_pages");
+  pn = v2p(v) / PGSIZE;
+  for(i = 0; i < 1 << order; i++){
+    if(kmem.refs[pn + i] != 1)
+      panic("free_pages: shared page");
+    kmem.refs[pn + i] = 0;
+  }
+#ifdef DEBUG
+  memset(v, 1, PGSIZE << order);
+#endif
+  atomic_add(&free_pages_count, 1 << order);
+  acquire(&kmem.lock);
+  buddy_free(pn, order);
+  release(&kmem.lock);
+}
+
+// Copy the number of free blocks of each order to nfree, for
+// /proc/buddyinfo.  Returns how many free pages are cached by the
+// CPUs or zeroed in advance, outside any block.
+int
+buddyinfo(uint *nfree)
+{
+  struct magazine *m;
+  int i, cached;
+
+  acquire(&kmem.lock);
+  for(i = 0; i <= MAXORDER; i++)
+    nfree[i] = kmem.nfree[i];
+  release(&kmem.lock);
+  cached = zpool.n;
+  for(m = kmem.mag; m < kmem.mag + NCPU; m++)
+    cached += m->n;
+  return cached;
+}
+
+// Fill in the state of the zeroed page pool, for /proc/zeropool.
+void
+zeropoolinfo(uint *pages, uint *hits, uint *misses)
+{
+  *pages = zpool.n;
+  *hits = zero_hits;
+  *misses = zero_misses;
+}
@@ -3,15 +3,35 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "list.h"
+#include "kmalloc.h"
+
+#define NCACHE     48  // Caches kmem_cache_create() can make
+#define CPU_CACHE  16  // Free blocks a CPU keeps of each cache at most
+#define CPU_BATCH   8  // Blocks moved between a CPU and its cache at once
+
+// Free blocks of a cache kept by one CPU, linked through their
+// first word, so that most kmem_cache_alloc() and kmem_cache_free()
+// calls take no lock.  Only its CPU uses it, with interrupts off,
+// and it has a cache line to itself.
+struct cpu_cache
+{
+  void* free;
+  unsigned int count;
+} __attribute__((__aligned__(64)));
 
 struct cache_info
 {
+  struct spinlock lock;  // Protects the lists and the pages on them
   unsigned int block_size;
+  unsigned int order;  // Each page of the cache is 2^order pages long
   struct list_head partial_list;
   struct list_head full_list;
   struct list_head empty_list;
+  struct cpu_cache cpu[NCPU];
 };
 
 struct page_header
@@ -22,18 +42,83 @@ struct page_header
   struct list_head list;
 };
 
+// Describes a page of a cache for big blocks, which keeps its
+// header out of the page (see page_headers), or a kmalloc() block
+// of whole pages, which is in pages_index so that kmfree() can
+// find how long it is.
 struct big_page_hash_info
 {
   void* page;
   struct page_header header;
   struct big_page_hash_info* next;
+  unsigned int order;  // Of a kmalloc() block of whole pages
 };
 
-struct cache_info* cache_table;
+struct cache_info cache_table[NCACHE];
 unsigned int cache_count = 0;
-struct big_page_hash_info** pages_hash_table;
+struct spinlock caches_lock;  // Protects cache_count
 struct cache_info* big_page_hash_info_cache;
-struct spinlock caches_lock;
+
+// The header of every page of the caches, by physical page number,
+// so that freeing a block takes no shared lock to find it.  Pages
+// of caches for small blocks hold their own header; the others have
+// it in their big_page_hash_info.  0 for pages not in a cache.
+struct page_header* page_headers[PHYSTOP / PGSIZE];
+
+static void
+set_page_headers(void* page, unsigned int order, struct page_header* header)
+{
+  for (unsigned int i = 0; i < (1 << order); ++i) {
+    page_headers[V2P(page) / PGSIZE + i] = header;
+  }
+}
+
+// The big_page_hash_info of every kmalloc() block of whole pages
+// by address: a hash table that doubles its buckets whenever it
+// holds twice as many entries as it has buckets, so that chains
+// stay short however many of them there are.
+struct {
+  struct spinlock lock;
+  struct big_page_hash_info** buckets;
+  unsigned int order;     // The buckets take 2^order pages
+  unsigned int nbuckets;  // A power of two
+  unsigned int count;
+} pages_index;
+
+static unsigned int
+page_bucket(void* page, unsigned int nbuckets)
+{
+  return ((unsigned int)page / PGSIZE) & (nbuckets - 1);
+}
+
+// Move the entries of pages_index to twice as many buckets.  If
+// there is no memory for them, the chains just get longer.
+// pages_index.lock must be held.
+static void
+grow_pages_index(void)
+{
+  unsigned int order = pages_index.order + 1;
+  if (order > MAXORDER) return;
+  struct big_page_hash_info** buckets =
+    (struct big_page_hash_info**)alloc_pages(order);
+  if (buckets == 0) return;
+  memset(buckets, 0, PGSIZE << order);
+  unsigned int nbuckets = (PGSIZE << order) / sizeof(*buckets);
+  for (unsigned int i = 0; i < pages_index.nbuckets; ++i) {
+    struct big_page_hash_info* info = pages_index.buckets[i];
+    while (info != 0) {
+      struct big_page_hash_info* next = info->next;
+      unsigned int index = page_bucket(info->page, nbuckets);
+      info->next = buckets[index];
+      buckets[index] = info;
+      info = next;
+    }
+  }
+  free_pages((char*)pages_index.buckets, pages_index.order);
+  pages_index.buckets = buckets;
+  pages_index.order = order;
+  pages_index.nbuckets = nbuckets;
+}
 
 // Given a free page and a cache, add the page to that cache and
 // initialize the page as needed for small objects.
@@ -53,6 +138,7 @@ init_small_page(void* page, struct cache_info* info)
     .empty_count = count
   };
   list_add(&((struct page_header*)page)->list, &info->empty_list);
+  set_page_headers(page, 0, (struct page_header*)page);
   void* last_ptr;
   for (void* ptr = page + sizeof(struct page_header);
       ptr <= page + PGSIZE - block_size;
@@ -65,9 +151,10 @@ init_small_page(void* page, struct cache_info* info)
 }
 
 unsigned int
-get_number_of_blocks(int block_size)
+get_number_of_blocks(struct cache_info* info)
 {
-  if ((block_size * 8) >= PGSIZE) return PGSIZE / block_size;
+  unsigned int block_size = info->block_size;
+  if ((block_size * 8) >= PGSIZE) return (PGSIZE << info->order) / block_size;
   return (PGSIZE - sizeof(struct page_header)) / block_size;
 }
 
@@ -94,16 +181,23 @@ get_empty_block_from_page(struct page_header* header)
 void
 add_to_hash_table(struct big_page_hash_info* page_hash_info)
 {
-  unsigned int index = (((unsigned int)page_hash_info->page) / PGSIZE) % 1024;
-  struct big_page_hash_info* next = pages_hash_table[index];
-  page_hash_info->next = next;
-  pages_hash_table[index] = page_hash_info;
+  acquire(&pages_index.lock);
+  unsigned int index =
+    page_bucket(page_hash_info->page, pages_index.nbuckets);
+  page_hash_info->next = pages_index.buckets[index];
+  pages_index.buckets[index] = page_hash_info;
+  if (++pages_index.count > 2 * pages_index.nbuckets) {
+    grow_pages_index();
+  }
+  release(&pages_index.lock);
 }
 
 int init_big_page(void*, struct cache_info*);
+struct big_page_hash_info* delete_big_page_hash_info(void*);
+void free_block(void*);
 
 // Returns pointer to the next empty block from the cache, in case of failure
-// returns 0.
+// returns 0.  The lock of the cache must be held.
 void*
 get_empty_block(struct cache_info* cache)
 {
@@ -115,12 +209,15 @@ get_empty_block(struct cache_info* cache)
   } else if (!list_empty(&cache->empty_list)) {
     header = list_entry(cache->empty_list.next, struct page_header, list);
   } else {
-    void* page = kalloc();
+    void* page = alloc_pages(cache->order);
     if (page == 0) return 0;
     int result = 0;
     if (is_big) result = init_big_page(page, cache);
     else result = init_small_page(page, cache);
-    if (result < 0) return 0;
+    if (result < 0) {
+      free_pages(page, cache->order);
+      return 0;
+    }
     header = list_entry(cache->empty_list.next, struct page_header, list);
   }
   return get_empty_block_from_page(header);
@@ -135,23 +232,25 @@ init_big_page(void* page, struct cache_info* cache)
   if ((unsigned int)page % PGSIZE) {
     panic("page address not page-aligned (init_big_page)");
   }
+  unsigned int size = PGSIZE << cache->order;
   struct big_page_hash_info* hash_info =
-    get_empty_block(big_page_hash_info_cache);
-  if (hash_info == 0) return -1;
+    kmem_cache_alloc(big_page_hash_info_cache);
+  if (hash_info == 0) {
+    return -1;
+  }
   unsigned int block_size = cache->block_size;
   *hash_info = (struct big_page_hash_info) {
     .page = page,
     .header = {
       .cache_info = cache,
       .empty_block = page,
-      .empty_count = PGSIZE / block_size,
+      .empty_count = get_number_of_blocks(cache),
     },
-    .next = 0,
   };
   list_add(&hash_info->header.list, &cache->empty_list);
-  add_to_hash_table(hash_info);
+  set_page_headers(page, cache->order, &hash_info->header);
   void* last;
-  for (unsigned int i = 0; i < PGSIZE; i += block_size) {
+  for (unsigned int i = 0; i + block_size <= size; i += block_size) {
     *(void**)(page + i) = page + i + block_size;
     last = page + i;
   }
@@ -159,25 +258,7 @@ init_big_page(void* page, struct cache_info* cache)
   return 0;
 }
 
-// Get hash_info structure for the given address
-// (which must be page-aligned).
-// Returns 0 when the corresponding hash_info was not found.
-struct big_page_hash_info*
-get_big_page_hash_info(void* page)
-{
-  if ((unsigned int)page % PGSIZE) {
-    panic("page address not page-aligned (get_big_page_hash_info)");
-  }
-  unsigned int index = (((unsigned int)page) / PGSIZE) % 1024;
-  struct big_page_hash_info* next = pages_hash_table[index];
-  while (next != 0) {
-    if (next->page == (void*)PGROUNDDOWN((unsigned int)page)) break;
-    next = next->next;
-  }
-  return next;
-}
-
-// Delete hash info for the given page from pages_hash_table.
+// Delete hash info for the given page from pages_index.
 // hash_info object itself is not deleted.
 // If page is not found, returns 0.
 // page address must be page-aligned.
@@ -187,26 +268,31 @@ delete_big_page_hash_info(void* page)
   if ((unsigned int)page % PGSIZE) {
     panic("page address not page-aligned (delete_big_page_hash_info)");
   }
-  unsigned int index = (PGROUNDDOWN((unsigned int)page) / PGSIZE) % 1024;
-  struct big_page_hash_info* current = pages_hash_table[index];
+  acquire(&pages_index.lock);
+  unsigned int index = page_bucket(page, pages_index.nbuckets);
+  struct big_page_hash_info* current = pages_index.buckets[index];
   struct big_page_hash_info* previous = 0;
   while (current != 0) {
-    if (current->page == (void*)PGROUNDDOWN((unsigned int)page)) break;
+    if (current->page == page) break;
     previous = current;
     current = current->next;
   }
   if (current != 0) {
     struct big_page_hash_info* next = current->next;
     if (previous == 0) {
-      pages_hash_table[index] = next;
+      pages_index.buckets[index] = next;
     } else {
       previous->next = next;
     }
     current->next = 0;
+    pages_index.count--;
   }
+  release(&pages_index.lock);
   return current;
 }
 
+void free_page(struct page_header*);
+
 // Mark the given block from the given page as free.
 // The block must be from the same page that the page_header 
 // describes.
@@ -214,9 +300,11 @@ void
 free_page_block(void* block, struct page_header* page_header)
 {
   void* previous_empty = page_header->empty_block;
+  // Pages of several pages are aligned to their size.
+  unsigned int mask = ~((PGSIZE << page_header->cache_info->order) - 1);
   *(void**)block = previous_empty;
   if (previous_empty != 0 &&
-      (PGROUNDDOWN((unsigned int)block) != PGROUNDDOWN((unsigned int)previous_empty))) {
+      (((unsigned int)block & mask) != ((unsigned int)previous_empty & mask))) {
     panic("block is not in the page");
   } else if ((page_header->cache_info->block_size * 8) < PGSIZE) {
     if (PGROUNDDOWN((unsigned int)block) != PGROUNDDOWN((unsigned int)page_header)) {
@@ -227,81 +315,89 @@ free_page_block(void* block, struct page_header* page_header)
   }
   page_header->empty_block = block;
   struct cache_info* cache_info = page_header->cache_info;
-  unsigned int block_size = cache_info->block_size;
   page_header->empty_count += 1;
-  if (page_header->empty_count == get_number_of_blocks(block_size)) {
+  if (page_header->empty_count == get_number_of_blocks(cache_info)) {
     // All the blocks in the page are free, we will free the page now.
-    list_del(&page_header->list);
-    kfree((void*)PGROUNDDOWN((unsigned int)block));
-    return;
-    if (!list_empty(&cache_info->empty_list)) {
-    } else {
-      list_add(&page_header->list, &cache_info->empty_list);
-    }
+    free_page(page_header);
   } else if (page_header->empty_count == 1) {
     list_del(&page_header->list);
     list_add(&page_header->list, &cache_info->partial_list);
   }
 }
 
+// Header of the page the given block is in.
+struct page_header*
+block_header(void* block)
+{
+  return page_headers[V2P(block) / PGSIZE];
+}
+
 // Mark the given block as free.
+// The lock of its cache must be held.
 void
 free_block(void* block)
 {
-  void* page = (void*)PGROUNDDOWN((unsigned int)block);
-  struct big_page_hash_info* hash_info = get_big_page_hash_info(page);
-  if (hash_info) {
-    free_page_block(block, &hash_info->header);
-  } else {
-    free_page_block(block, (struct page_header*)page);
-  }
+  free_page_block(block, block_header(block));
 }
 
-// Delete the page from all the lists and kfree() it.
-// page address must be page-aligned.
+// Delete the page with all its blocks free from the lists of its
+// cache, and give it back to the page allocator.
 void
-free_page(void* page)
+free_page(struct page_header* header)
 {
-  if ((unsigned int)page % PGSIZE) {
-    panic("page address not page-aligned (free_page)");
+  struct cache_info* cache = header->cache_info;
+  if (header->empty_count != get_number_of_blocks(cache)) {
+    panic("Freeing page with blocks in use in free_page");
   }
-  struct page_header* header;
-  struct big_page_hash_info* hash_info = delete_big_page_hash_info(page);
-  if (hash_info == 0) {
-    header = (struct page_header*)PGROUNDDOWN((unsigned int)page);
-    if (header->empty_count != 0)
-    {
-      panic("Freeing non-empty small page in free_page");
-    }
-    list_del(&header->list);
-  } else {
-    header = &hash_info->header;
-    if (header->empty_count != 0)
-    {
-      panic("Freeing non-empty big page in free_page");
-    }
-    list_del(&header->list);
-    free_block(hash_info);
+  list_del(&header->list);
+  if ((cache->block_size * 8) < PGSIZE) {
+    set_page_headers(header, 0, 0);
+    kfree((void*)header);
+    return;
   }
-  kfree((void*)PGROUNDDOWN((unsigned int)page));
+  struct big_page_hash_info* hash_info =
+    list_entry(header, struct big_page_hash_info, header);
+  void* page = hash_info->page;
+  set_page_headers(page, cache->order, 0);
+  kmem_cache_free(hash_info);
+  free_pages(page, cache->order);
+}
+
+// How many pages long the pages of a cache for blocks of the given
+// size are: one for blocks up to PGSIZE, otherwise as few as waste
+// no more than an eighth of the page.
+static unsigned int
+slab_order(unsigned int block_size)
+{
+  unsigned int order = 0;
+  if (block_size <= PGSIZE) return 0;
+  while ((PGSIZE << order) < block_size ||
+      (PGSIZE << order) % block_size > (PGSIZE << order) / 8) {
+    if (order == MAXORDER) break;
+    order++;
+  }
+  return order;
 }
 
 // Creates new cache with given block size and returns a pointer to it.
 struct cache_info*
 kmem_cache_create(unsigned int block_size)
 {
-  if (PGSIZE < block_size) {
-    return 0;
-  }
-  if (cache_count >= PGSIZE / sizeof(struct cache_info)) {
+  if ((PGSIZE << MAXORDER) < block_size) {
     return 0;
   }
   if (block_size < sizeof(struct page_header)) {
     block_size = sizeof(struct page_header);
   }
   acquire(&caches_lock);
+  if (cache_count >= NCACHE) {
+    release(&caches_lock);
+    return 0;
+  }
   struct cache_info* result = &cache_table[cache_count++];
+  initlock(&result->lock, "kmem_cache");
   result->block_size = block_size;
+  result->order = slab_order(block_size);
   INIT_LIST_HEAD(&result->partial_list);
   INIT_LIST_HEAD(&result->full_list);
   INIT_LIST_HEAD(&result->empty_list);
@@ -309,14 +405,52 @@ kmem_cache_create(unsigned int block_size)
   return result;
 }
 
+// Move up to n free blocks from the lists of the cache to the
+// CPU's cache of it.
+static void
+refill(struct cache_info* cache, struct cpu_cache* cc, int n)
+{
+  acquire(&cache->lock);
+  while (n-- > 0) {
+    void* block = get_empty_block(cache);
+    if (block == 0) break;
+    *(void**)block = cc->free;
+    cc->free = block;
+    cc->count++;
+  }
+  release(&cache->lock);
+}
+
+// Give n blocks from the CPU's cache back to their pages.
+static void
+drain(struct cache_info* cache, struct cpu_cache* cc, int n)
+{
+  acquire(&cache->lock);
+  while (n-- > 0 && cc->free != 0) {
+    void* block = cc->free;
+    cc->free = *(void**)block;
+    cc->count--;
+    free_block(block);
+  }
+  release(&cache->lock);
+}
+
 // Allocate one block from memory.
 // Returns 0 on failure.
 void*
 kmem_cache_alloc(struct cache_info* cache)
 {
-  acquire(&caches_lock);
-  void* result = get_empty_block(cache);
-  release(&caches_lock);
+  pushcli();
+  struct cpu_cache* cc = &cache->cpu[cpu - cpus];
+  if (cc->free == 0) {
+    refill(cache, cc, CPU_BATCH);
+  }
+  void* result = cc->free;
+  if (result != 0) {
+    cc->free = *(void**)result;
+    cc->count--;
+  }
+  popcli();
   return result;
 }
 
@@ -324,24 +458,118 @@ kmem_cache_alloc(struct cache_info* cache)
 void
 kmem_cache_free(void* block)
 {
-  acquire(&caches_lock);
-  free_block(block);
-  release(&caches_lock);
+  struct cache_info* cache = block_header(block)->cache_info;
+  pushcli();
+  struct cpu_cache* cc = &cache->cpu[cpu - cpus];
+  *(void**)block = cc->free;
+  cc->free = block;
+  if (++cc->count > CPU_CACHE) {
+    drain(cache, cc, CPU_BATCH);
+  }
+  popcli();
+}
+
+// kmalloc() size classes: powers of two from 32 bytes up to
+// KMALLOC_MAX, and halfway between each two of them, so that no
+// more than a third of a block is wasted.
+#define KMALLOC_MAX 8192
+#define NKMALLOC 17
+
+struct cache_info* kmalloc_caches[NKMALLOC];
+
+// Size of class c: 32, 48, 64, 96, 128, ..., 6144, 8192.
+static unsigned int
+kmalloc_size(unsigned int c)
+{
+  return (c % 2 ? 48 : 32) << (c / 2);
+}
+
+// Smallest class whose blocks hold size bytes, size <= KMALLOC_MAX.
+static unsigned int
+kmalloc_class(unsigned int size)
+{
+  unsigned int c = 0;
+  while (kmalloc_size(c) < size) {
+    ++c;
+  }
+  return c;
 }
 
 // Initialize all cache data structures.
 void
 init_caches(void)
 {
-  cache_table = (struct cache_info*)kalloc();
-  pages_hash_table = (struct big_page_hash_info**)kalloc();
-  memset(cache_table, 0, PGSIZE);
-  memset(pages_hash_table, 0, PGSIZE);
+  initlock(&caches_lock, "caches");
+  initlock(&pages_index.lock, "pages_index");
+  pages_index.buckets = (struct big_page_hash_info**)kalloc();
+  memset(pages_index.buckets, 0, PGSIZE);
+  pages_index.order = 0;
+  pages_index.nbuckets = PGSIZE / sizeof(*pages_index.buckets);
   big_page_hash_info_cache =
     kmem_cache_create(sizeof(struct big_page_hash_info));
   if (big_page_hash_info_cache == 0) {
     panic("Can't allocate cache?!");
   }
+  for (unsigned int c = 0; c < NKMALLOC; ++c) {
+    if ((kmalloc_caches[c] = kmem_cache_create(kmalloc_size(c))) == 0) {
+      panic("Can't allocate kmalloc caches");
+    }
+  }
+}
 
-  initlock(&caches_lock, "caches");
+// Allocate size bytes for the kernel.  Up to KMALLOC_MAX bytes
+// come from the cache of the smallest size class that fits them,
+// larger blocks are runs of whole pages.  flags is 0 or KM_ZERO
+// for zeroed memory.  Returns 0 if out of memory.  Free the block
+// with kmfree().
+void*
+kmalloc(unsigned int size, int flags)
+{
+  void* result;
+
+  if (size == 0) {
+    size = 1;
+  }
+  if (size <= KMALLOC_MAX) {
+    result = kmem_cache_alloc(kmalloc_caches[kmalloc_class(size)]);
+  } else {
+    unsigned int order = 0;
+    while ((PGSIZE << order) < size) {
+      if (++order > MAXORDER) return 0;
+    }
+    struct big_page_hash_info* info =
+      kmem_cache_alloc(big_page_hash_info_cache);
+    if (info == 0) return 0;
+    if ((result = alloc_pages(order)) == 0) {
+      kmem_cache_free(info);
+      return 0;
+    }
+    *info = (struct big_page_hash_info) {
+      .page = result,
+      .order = order,
+    };
+    add_to_hash_table(info);
+  }
+  if (result != 0 && (flags & KM_ZERO)) {
+    memset(result, 0, size);
+  }
+  return result;
+}
+
+// Free a block returned by kmalloc().
+void
+kmfree(void* block)
+{
+  if (block == 0) return;
+  // Only runs of whole pages are in no cache.
+  if (block_header(block) == 0) {
+    struct big_page_hash_info* info = delete_big_page_hash_info(block);
+    if (info == 0) {
+      panic("kmfree: not allocated by kmalloc");
+    }
+    free_pages(block, info->order);
+    kmem_cache_free(info);
+    return;
+  }
+  kmem_cache_free(block);
 }
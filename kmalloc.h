@@ -0,0 +1,7 @@
+#ifndef XV6_KMALLOC_H
+#define XV6_KMALLOC_H
+
+// kmalloc() flags
+#define KM_ZERO 0x1  // Zero the block
+
+#endif
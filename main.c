@@ -29,8 +29,11 @@ main(void)
   init_caches();   // memory cache init
   uartinit();      // serial port
   pinit();         // process table
+  timeoutinit();   // timer wheel
+  futexinit();     // futex hash locks
   tvinit();        // trap vectors
   binit();         // buffer cache
+  textinit();      // program text page cache
   fileinit();      // file table
   iinit();         // inode cache
   ideinit();       // disk
@@ -39,6 +42,8 @@ main(void)
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
   userinit();      // first user process
+  reaperinit();    // frees exited detached processes
+  zeroinit();      // zeroes pages in advance when idle
   // Finish setting up this processor in mpmain.
   mpmain();
 }
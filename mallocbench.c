@@ -0,0 +1,74 @@
+// Malloc churn: every thread keeps NSLOTS blocks alive and keeps
+// replacing random ones by blocks of random sizes, mostly small
+// with the odd large one.  Run with 1 to MAXTHREADS threads, and
+// show how much of the heap is left once everything is freed.
+
+#include "types.h"
+#include "user.h"
+
+#define MAXTHREADS 4
+#define NSLOTS 256
+#define ITERS 40000
+
+static uint
+next_random(uint* state)
+{
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+void*
+churn(void* arg)
+{
+  void* slots[NSLOTS];
+  uint state = (uint)arg;
+
+  memset(slots, 0, sizeof(slots));
+  for (int i = 0; i < ITERS; ++i) {
+    uint r = next_random(&state);
+    int slot = r % NSLOTS;
+    uint size = (r / NSLOTS) % 64 == 0 ? 4096 + r % 16384 : 8 + r % 512;
+    free(slots[slot]);
+    if ((slots[slot] = malloc(size)) == 0) {
+      printf(2, "mallocbench: out of memory\n");
+      exit();
+    }
+    *(char*)slots[slot] = 1;
+  }
+  for (int i = 0; i < NSLOTS; ++i) {
+    free(slots[i]);
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  thread_t threads[MAXTHREADS];
+  char* start_brk = sbrk(0);
+
+  printf(1, "mallocbench: %d malloc/free per thread\n", ITERS);
+  for (int n = 1; n <= MAXTHREADS; n *= 2) {
+    int start = uptime();
+    if (n == 1) {
+      churn((void*)1);
+    } else {
+      for (int i = 0; i < n; ++i) {
+        if (thread_create(&threads[i], churn, (void*)(i + 1), 0) < 0) {
+          printf(2, "mallocbench: thread_create failed\n");
+          exit();
+        }
+      }
+      for (int i = 0; i < n; ++i) {
+        thread_join(threads[i], 0);
+      }
+    }
+    int elapsed = uptime() - start;
+    printf(1, "%d threads: %d ticks, heap left at %d KB\n", n, elapsed,
+        (sbrk(0) - start_brk) / 1024);
+  }
+  malloc_thread_exit();
+  printf(1, "heap left at %d KB once the main thread's cache is flushed\n",
+      (sbrk(0) - start_brk) / 1024);
+  exit();
+}
@@ -1,6 +1,7 @@
 #include "user.h"
 #include "mmap.h"
 #include "fcntl.h"
+#include "futex.h"
 
 int main(int argc, char** argv)
 {
@@ -18,12 +19,14 @@ int main(int argc, char** argv)
       continue;
     }
     while (p[1] <= n) {
-      while (p[0] != i) { }
+      while (p[0] != i) {
+        futex(&p[0], FUTEX_WAIT, 3 - i, 0);
+      }
       if (p[1] > n) break;
       /*std::cout << i << ' ' << p[1]++ << std::endl;*/
       printf(1, "%d %d\n", i, p[1]++);
       p[0] = 3 - p[0];
-      sched_yield();
+      futex(&p[0], FUTEX_WAKE, 1, 0);
     }
     exit();
   }
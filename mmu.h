@@ -45,6 +45,7 @@
 #define SEG_UCODE 4  // user code
 #define SEG_UDATA 5  // user data+stack
 #define SEG_TSS   6  // this process's task state
+#define SEG_UTLS  7  // this thread's thread-local storage
 
 //PAGEBREAK!
 #ifndef __ASSEMBLER__
@@ -140,6 +141,7 @@ struct segdesc {
 #define PTE_PS          0x080   // Page Size
 #define PTE_MBZ         0x180   // Bits must be zero
 #define PTE_MMAP        0x200   // Part of a shared mmap
+#define PTE_COW         0x400   // Shared after fork, copy on write
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -0,0 +1,34 @@
+#include "types.h"
+#include "user.h"
+#include "errno.h"
+
+// nice [-n adjustment] prog [args]
+// Run prog with its nice value changed by adjustment (default 10).
+int main(int argc, char** argv)
+{
+  int inc = 10;
+  int i = 1;
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    if (argv[2][0] == '-') {
+      inc = -atoi(argv[2] + 1);
+    } else {
+      inc = atoi(argv[2]);
+    }
+    i = 3;
+  }
+  if (i >= argc) {
+    printf(2, "Usage: nice [-n adjustment] prog [args]\n");
+    return 1;
+  }
+  if (nice(inc) < 0) {
+    if (errno == EPERM) {
+      printf(2, "Permission denied\n");
+      return 1;
+    }
+    printf(2, "nice error. Errno: %d\n", errno);
+    return 1;
+  }
+  execvpe(argv[i], argv + i, environ);
+  printf(2, "Failed to execute %s. Errno = %d\n", argv[i], errno);
+  return 1;
+}
@@ -4,6 +4,9 @@
 #define NOFILE      128  // open files per process
 #define NFILE       100  // open files per system
 #define NBUF         10  // size of disk block cache
+#define NTEXTPAGE  1024  // size of program text page cache
+#define MAXORDER     10  // alloc_pages() hands out up to 2^MAXORDER pages
+#define NZEROPAGE   128  // pages kept zeroed in advance, see kalloc_zeroed()
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
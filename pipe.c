@@ -93,10 +93,12 @@ pipewrite(struct pipe *p, char *addr, int n)
   return n;
 }
 
+// Wait at most timeout ticks for data, or forever if timeout is 0.
 int
-piperead(struct pipe *p, char *addr, int n)
+piperead(struct pipe *p, char *addr, int n, int timeout)
 {
   int i;
+  uint end = ticks + timeout;
 
   acquire(&p->lock);
   while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
@@ -104,7 +106,15 @@ piperead(struct pipe *p, char *addr, int n)
       release(&p->lock);
       return -EBADF;
     }
-    sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    if(timeout == 0){
+      sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    } else if((int)(end - ticks) <= 0 ||
+              sleep_timeout(&p->nread, &p->lock, end - ticks) < 0){
+      if(p->nread == p->nwrite && p->writeopen){
+        release(&p->lock);
+        return -ETIMEDOUT;
+      }
+    }
   }
   for(i = 0; i < n; i++){  //DOC: piperead-copy
     if(p->nread == p->nwrite)
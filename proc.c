@@ -13,12 +13,17 @@
 #include "stat.h"
 #include "err.h"
 #include "buf.h"
+#include "traps.h"
+#include "resource.h"
+#include "sched.h"
+#include "timeout.h"
 
 struct ptable ptable;
 
 static struct proc *initproc;
 
 struct cache_info* proc_cache;
+struct cache_info* task_group_cache;
 struct cache_info* mm_cache;
 struct cache_info* files_struct_cache;
 struct cache_info* fs_info_cache;
@@ -28,17 +33,75 @@ struct cache_info* mmap_list_cache;
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
+static void spawnret(void);
 
-static void wakeup1(void *chan);
+// Sleeping processes, hashed by the channel they sleep on.
+// Each bucket lock protects the SLEEPING state and p->chan
+// of the processes in its list.
+#define WAITQ_SHIFT 6
+#define NWAITQ (1 << WAITQ_SHIFT)
+
+struct waitqueue {
+  struct spinlock lock;
+  struct list_head list;
+};
+
+static struct waitqueue waitqueues[NWAITQ];
+
+// Processes hashed by pid, so that lookups neither scan
+// ptable.list nor take ptable.lock.
+#define NPIDHASH 64
+
+static struct {
+  struct spinlock lock;
+  struct list_head buckets[NPIDHASH];
+} pidhash;
+
+// Detached processes that have exited, waiting for the reaper
+// thread to free their memory.  Linked through p->run_list.
+static struct {
+  struct spinlock lock;
+  struct list_head list;
+} reaplist;
+
+// Protects rq->dl_bw of all CPUs, see sched_setattr().
+static struct spinlock dl_lock;
+
+static void wakeup_proc(struct proc* p);
+static void requeue_self(void);
 
 void
 pinit(void)
 {
   initlock(&ptable.lock, "ptable");
+  for (int i = 0; i < NWAITQ; ++i) {
+    initlock(&waitqueues[i].lock, "waitqueue");
+    INIT_LIST_HEAD(&waitqueues[i].list);
+  }
+  initlock(&pidhash.lock, "pidhash");
+  for (int i = 0; i < NPIDHASH; ++i) {
+    INIT_LIST_HEAD(&pidhash.buckets[i]);
+  }
+  initlock(&dl_lock, "dl_bw");
+  initlock(&reaplist.lock, "reaplist");
+  INIT_LIST_HEAD(&reaplist.list);
+  for (int i = 0; i < NCPU; ++i) {
+    initlock(&cpus[i].rq.lock, "runqueue");
+    for (int q = 0; q < NPRIO; ++q) {
+      INIT_LIST_HEAD(&cpus[i].rq.queue[q]);
+    }
+    INIT_LIST_HEAD(&cpus[i].rq.dl);
+    INIT_LIST_HEAD(&cpus[i].rq.dl_throttled);
+    cpus[i].rq.nr_running = 0;
+  }
   proc_cache = kmem_cache_create(sizeof(struct proc));
   if (proc_cache == 0) {
     panic("Could not allocate proc cache");
   }
+  task_group_cache = kmem_cache_create(sizeof(struct task_group));
+  if (task_group_cache == 0) {
+    panic("Could not allocate task_group cache");
+  }
   mm_cache = kmem_cache_create(sizeof(struct mm_struct));
   if (mm_cache == 0) {
     panic("Could not allocate mm_struct cache");
@@ -62,6 +125,529 @@ pinit(void)
   INIT_LIST_HEAD(&ptable.list);
 }
 
+// Multi-level feedback queue.
+// A process that uses up its time slice moves down a level,
+// one that goes to sleep before that moves up a level when woken.
+// Every PRIO_BOOST_TICKS everything moves back to the top, so
+// CPU-bound processes are not starved by a stream of short ones.
+// The nice value shifts the level a process is queued at.
+#define PRIO_SLICE(q)     (1 << (q))  // Ticks of a time slice at level q
+#define PRIO_BOOST_TICKS  100
+
+// Level of the queue that p goes to.
+static int
+proc_prio(struct proc* p)
+{
+  int q = p->level + (p->nice - PRIO_MIN) / 10 - 2;
+  if (q < 0)
+    return 0;
+  if (q >= NPRIO)
+    return NPRIO - 1;
+  return q;
+}
+
+// Move the processes of the lower levels of rq back up
+// if a boost period has passed since the last time.
+// rq->lock must be held.
+static void
+rq_boost(struct runqueue* rq)
+{
+  uint boost = ticks / PRIO_BOOST_TICKS;
+  if (rq->boost == boost) {
+    return;
+  }
+  rq->boost = boost;
+  for (int q = 1; q < NPRIO; ++q) {
+    struct list_head *pos, *next;
+    list_for_each_safe(pos, next, &rq->queue[q]) {
+      struct proc* p = list_entry(pos, struct proc, run_list);
+      p->level = 0;
+      p->slice_ticks = 0;
+      if (proc_prio(p) != q) {
+        list_del(&p->run_list);
+        list_add_tail(&p->run_list, &rq->queue[proc_prio(p)]);
+      }
+    }
+  }
+}
+
+// Fair sharing between thread groups, and optionally users.
+// Every tick a process runs is charged to its task_group, which
+// all threads of the group share, and to the group of its uid.
+// Among the processes queued at the same level the one whose group
+// has used the least runs first, so a process with 30 threads gets
+// about as much CPU as one with a single thread.
+// With sched_group_by_uid set users are compared first, then
+// thread groups of the same user.
+#define NUIDGROUP          16
+#define FAIR_SLEEP_CREDIT  10  // Ticks a woken group may be behind others
+
+int sched_group_by_uid;
+
+// Hashed by uid, users that share a slot share their CPU time.
+static struct task_group uid_groups[NUIDGROUP];
+
+// a is less than b, allowing for wraparound.
+#define VRUNTIME_BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+static struct task_group*
+uid_group(struct proc* p)
+{
+  return &uid_groups[(uint)p->uid % NUIDGROUP];
+}
+
+static struct task_group*
+alloc_task_group(uint vruntime)
+{
+  struct task_group* tg = kmem_cache_alloc(task_group_cache);
+  if (tg == 0) {
+    return 0;
+  }
+  tg->vruntime = vruntime;
+  tg->users = 1;
+  return tg;
+}
+
+// A group that slept for long should not monopolize the CPU
+// until it has used as much as the others.  Catch it up with
+// the runqueue, less some credit for sleeping.
+// A tick charged concurrently on another CPU may be lost.
+static void
+place_group(struct task_group* tg, uint min_vruntime)
+{
+  uint floor = min_vruntime - FAIR_SLEEP_CREDIT;
+  if (VRUNTIME_BEFORE(tg->vruntime, floor))
+    tg->vruntime = floor;
+}
+
+// Should a run before b?
+static int
+fair_before(struct proc* a, struct proc* b)
+{
+  if (sched_group_by_uid && uid_group(a) != uid_group(b))
+    return VRUNTIME_BEFORE(uid_group(a)->vruntime, uid_group(b)->vruntime);
+  return VRUNTIME_BEFORE(a->tg->vruntime, b->tg->vruntime);
+}
+
+// May p run on cpus[i]?
+static int
+cpu_allowed(struct proc* p, int i)
+{
+  return (p->cpus_allowed >> i) & 1;
+}
+
+// Return the process of queue that should run next, considering
+// only those allowed on cpus[i] unless i is -1.
+// On ties the one queued first wins.
+static struct proc*
+pick_fair(struct list_head* queue, int i)
+{
+  struct proc *p, *best = 0;
+  list_for_each_entry(p, queue, run_list) {
+    if (i >= 0 && !cpu_allowed(p, i))
+      continue;
+    if (best == 0 || fair_before(p, best))
+      best = p;
+  }
+  return best;
+}
+
+// Earliest deadline first.
+// SCHED_DEADLINE processes run ahead of all others.  Each is bound
+// to the CPU it was admitted on, which runs them in the order of
+// the deadlines of their current jobs.  A job gets dl_runtime ticks;
+// once it has used them, or has ended early with sched_yield(), the
+// process waits on rq->dl_throttled until its next period starts.
+// Admission keeps the sum of runtime / period on each CPU under
+// DL_BW_MAX, so all jobs can meet their deadlines and the normal
+// processes still get some time.
+#define DL_BW_SHIFT    16
+#define DL_BW_MAX      ((95 << DL_BW_SHIFT) / 100)
+#define DL_PERIOD_MAX  (1 << 15)  // Keeps runtime << DL_BW_SHIFT in a uint
+
+// a is before b, allowing for wraparound.
+#define TICKS_BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+// Start the next job of p, when its period started if p
+// is keeping up, or now if it fell behind by a whole period.
+static void
+dl_start_job(struct proc* p)
+{
+  uint start = p->dl_period_at;
+  if (!TICKS_BEFORE(ticks, start + p->dl_period))
+    start = ticks;
+  p->dl_left = p->dl_runtime;
+  p->dl_deadline_at = start + p->dl_deadline;
+  p->dl_period_at = start + p->dl_period;
+}
+
+// Queue p by deadline, or throttle it if its job is over
+// and the next period has not started.  rq->lock must be held.
+static void
+dl_enqueue(struct runqueue* rq, struct proc* p)
+{
+  if (p->dl_left <= 0 || !TICKS_BEFORE(ticks, p->dl_deadline_at)) {
+    // A killed process must get to run to exit.
+    if (TICKS_BEFORE(ticks, p->dl_period_at) && !p->killed) {
+      list_add_tail(&p->run_list, &rq->dl_throttled);
+      return;
+    }
+    dl_start_job(p);
+  }
+  struct proc* q;
+  list_for_each_entry(q, &rq->dl, run_list) {
+    if (TICKS_BEFORE(p->dl_deadline_at, q->dl_deadline_at))
+      break;
+  }
+  list_add_tail(&p->run_list, &q->run_list);
+  rq->nr_running++;
+}
+
+// Queue the throttled processes whose next period has started.
+// rq->lock must be held.
+static void
+dl_replenish(struct runqueue* rq)
+{
+  struct list_head *pos, *next;
+  list_for_each_safe(pos, next, &rq->dl_throttled) {
+    struct proc* p = list_entry(pos, struct proc, run_list);
+    if (TICKS_BEFORE(ticks, p->dl_period_at) && !p->killed)
+      continue;
+    list_del(pos);
+    dl_enqueue(rq, p);
+  }
+}
+
+// Append p to the tail of its level in rq.  rq->lock must be held.
+static void
+rq_enqueue(struct runqueue* rq, struct proc* p)
+{
+  if (p->policy == SCHED_DEADLINE) {
+    dl_enqueue(rq, p);
+    return;
+  }
+  list_add_tail(&p->run_list, &rq->queue[proc_prio(p)]);
+  rq->nr_running++;
+}
+
+// Remove and return the SCHED_NORMAL process that should run next,
+// one of the highest non-empty level of rq, or 0 if there is none.
+// Unless i is -1 only processes allowed on cpus[i] are considered.
+// rq->lock must be held.
+static struct proc*
+rq_dequeue_normal(struct runqueue* rq, int i)
+{
+  rq_boost(rq);
+  for (int q = 0; q < NPRIO; ++q) {
+    struct proc* p = pick_fair(&rq->queue[q], i);
+    if (p) {
+      list_del_init(&p->run_list);
+      rq->nr_running--;
+      if (VRUNTIME_BEFORE(rq->min_vruntime, p->tg->vruntime))
+        rq->min_vruntime = p->tg->vruntime;
+      if (VRUNTIME_BEFORE(rq->min_uid_vruntime, uid_group(p)->vruntime))
+        rq->min_uid_vruntime = uid_group(p)->vruntime;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Remove and return the process that should run next on rq's CPU,
+// or 0 if rq is empty.  rq->lock must be held.
+static struct proc*
+rq_dequeue(struct runqueue* rq)
+{
+  dl_replenish(rq);
+  if (!list_empty(&rq->dl)) {
+    struct proc* p = list_entry(rq->dl.next, struct proc, run_list);
+    list_del_init(&p->run_list);
+    rq->nr_running--;
+    return p;
+  }
+  // A process whose affinity changed while it was queued here
+  // runs once more, then sched_tick() moves it.
+  return rq_dequeue_normal(rq, -1);
+}
+
+// Should a SCHED_DEADLINE process preempt the current one?
+static int
+dl_preempt(void)
+{
+  struct runqueue* rq = &cpu->rq;
+  int preempt = 0;
+
+  // Unlocked read, only a hint: no deadline processes here.
+  if (rq->dl_bw == 0)
+    return 0;
+  acquire(&rq->lock);
+  dl_replenish(rq);
+  if (!list_empty(&rq->dl)) {
+    struct proc* p = list_entry(rq->dl.next, struct proc, run_list);
+    preempt = proc->policy != SCHED_DEADLINE ||
+      TICKS_BEFORE(p->dl_deadline_at, proc->dl_deadline_at);
+  }
+  release(&rq->lock);
+  return preempt;
+}
+
+#define BALANCE_TICKS 10
+
+// Pull a process from the longest runqueue if it has at least
+// two more than ours.  Idle CPUs don't wait for this, they steal
+// (see scheduler()), but it also evens out CPUs that are all busy.
+// The two runqueue locks are never held together.
+static void
+balance(void)
+{
+  struct runqueue* rq = &cpu->rq;
+  struct runqueue* busiest = 0;
+  int max = rq->nr_running + 1;
+  for (int i = 0; i < ncpu; ++i) {
+    if (&cpus[i] == cpu) continue;
+    // Unlocked read, only a hint.
+    if (cpus[i].rq.nr_running > max) {
+      max = cpus[i].rq.nr_running;
+      busiest = &cpus[i].rq;
+    }
+  }
+  if (busiest == 0) {
+    return;
+  }
+  acquire(&busiest->lock);
+  struct proc* p = rq_dequeue_normal(busiest, cpu - cpus);
+  release(&busiest->lock);
+  if (p == 0) {
+    return;
+  }
+  acquire(&rq->lock);
+  rq_enqueue(rq, p);
+  release(&rq->lock);
+}
+
+// Called on every timer tick that interrupts the current process.
+// Returns 1 if it should yield: either its time slice or job is
+// over, or a process of a higher level or earlier deadline is
+// waiting on this CPU.
+// Reading the other levels without the lock is only a hint.
+int
+sched_tick(void)
+{
+  atomic_add(&proc->tg->vruntime, 1);
+  atomic_add(&uid_group(proc)->vruntime, 1);
+
+  if (cpu->ticks % BALANCE_TICKS == 0)
+    balance();
+
+  if (proc->policy == SCHED_DEADLINE) {
+    if (--proc->dl_left <= 0)
+      return 1;
+    return dl_preempt();
+  }
+  if (dl_preempt() || !cpu_allowed(proc, cpu - cpus))
+    return 1;
+
+  int q = proc_prio(proc);
+  if (++proc->slice_ticks >= PRIO_SLICE(q)) {
+    if (proc->level < NPRIO - 1)
+      proc->level++;
+    proc->slice_ticks = 0;
+    return 1;
+  }
+  for (int i = 0; i < q; ++i) {
+    if (!list_empty(&cpu->rq.queue[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Bring CPU c out of hlt if it is idle.
+static void
+kick_cpu(struct cpu* c)
+{
+  if (c != cpu && c->idle)
+    lapicipi(c->id, T_IRQ0 + IRQ_RESCHED);
+}
+
+// The CPU p should be queued on: the one it last ran on, which is
+// the most likely to still have its data cached, if it is allowed
+// there, else the least loaded one it is allowed on.
+static struct cpu*
+select_cpu(struct proc* p)
+{
+  if (p->policy == SCHED_DEADLINE)
+    return &cpus[p->dl_cpu];
+  if (cpu_allowed(p, p->last_cpu))
+    return &cpus[p->last_cpu];
+  struct cpu* best = &cpus[p->last_cpu];
+  int min = -1;
+  for (int i = 0; i < ncpu; ++i) {
+    // Unlocked read, only a hint.
+    if (cpu_allowed(p, i) && (min < 0 || cpus[i].rq.nr_running < min)) {
+      min = cpus[i].rq.nr_running;
+      best = &cpus[i];
+    }
+  }
+  return best;
+}
+
+// Mark p RUNNABLE and queue it, see select_cpu().
+// The caller must hold whatever lock protects p->state:
+// p's waitqueue lock if it is sleeping, ptable.lock if it is new.
+static void
+make_runnable(struct proc* p)
+{
+  struct cpu* c = select_cpu(p);
+  struct runqueue* rq = &c->rq;
+  acquire(&rq->lock);
+  place_group(p->tg, rq->min_vruntime);
+  place_group(uid_group(p), rq->min_uid_vruntime);
+  p->state = RUNNABLE;
+  rq_enqueue(rq, p);
+  int queued = rq->nr_running;
+  // release() is a full barrier: c->idle is read after
+  // nr_running is updated (see idle()).
+  release(&rq->lock);
+
+  if (c->idle) {
+    kick_cpu(c);
+  } else if (queued > 1 && p->policy != SCHED_DEADLINE) {
+    // c is busy and p will have to wait, let an idle CPU steal it.
+    for (int i = 0; i < ncpu; ++i) {
+      if (cpus[i].idle && cpu_allowed(p, i)) {
+        kick_cpu(&cpus[i]);
+        break;
+      }
+    }
+  }
+}
+
+// Take a process from the runqueue of cpus[i] for this CPU.
+// Deadline processes stay on the CPU they were admitted on.
+static struct proc*
+steal_from(int i)
+{
+  acquire(&cpus[i].rq.lock);
+  struct proc* p = rq_dequeue_normal(&cpus[i].rq, cpu - cpus);
+  release(&cpus[i].rq.lock);
+  return p;
+}
+
+// Take a process from the longest runqueue of some other CPU,
+// or from any other if all of that one's are bound elsewhere.
+// Called by an idle CPU, without its own rq->lock held
+// (two CPUs stealing from each other would deadlock otherwise).
+static struct proc*
+steal_proc(void)
+{
+  struct proc* p = 0;
+  int busiest = -1;
+  int max = 0;
+  for (int i = 0; i < ncpu; ++i) {
+    if (&cpus[i] == cpu) continue;
+    // Unlocked read, only a hint.
+    if (cpus[i].rq.nr_running > max) {
+      max = cpus[i].rq.nr_running;
+      busiest = i;
+    }
+  }
+  if (busiest < 0) {
+    return 0;
+  }
+  p = steal_from(busiest);
+  for (int i = 0; p == 0 && i < ncpu; ++i) {
+    if (&cpus[i] != cpu && i != busiest && cpus[i].rq.nr_running > 0)
+      p = steal_from(i);
+  }
+  return p;
+}
+
+// Could this CPU run something queued on cpus[i]?  Anything on
+// its own runqueue, but only SCHED_NORMAL processes allowed here
+// on the others, see steal_proc().
+static int
+has_work_from(int i)
+{
+  struct runqueue* rq = &cpus[i].rq;
+  struct proc* p;
+  int found = 0;
+
+  // Unlocked read, see idle() for why it is enough.
+  if (rq->nr_running == 0)
+    return 0;
+  if (&cpus[i] == cpu)
+    return 1;
+  acquire(&rq->lock);
+  for (int q = 0; q < NPRIO && !found; ++q) {
+    list_for_each_entry(p, &rq->queue[q], run_list) {
+      if (cpu_allowed(p, cpu - cpus)) {
+        found = 1;
+        break;
+      }
+    }
+  }
+  release(&rq->lock);
+  return found;
+}
+
+// Halt until an interrupt arrives, unless there is work
+// for this CPU.  Called from scheduler() with no locks held.
+// Processes queued elsewhere that this CPU may not take don't
+// keep it awake: whoever queues one this CPU may take sends it
+// an IPI, see make_runnable().
+static void
+idle(void)
+{
+  cli();
+  // Announce that we are about to halt before looking at the
+  // runqueues for the last time.  make_runnable() queues first
+  // and looks at cpu->idle second, so either we see its process
+  // here or it sees us idle and sends an IPI.
+  xchg(&cpu->idle, 1);
+  int pending = 0;
+  for (int i = 0; i < ncpu && !pending; ++i) {
+    pending = has_work_from(i);
+  }
+  if (pending == 0)
+    sti_hlt();
+  xchg(&cpu->idle, 0);
+}
+
+// Free the kernel stack, memory and the proc structure itself
+// and remove p from all the process lists.
+// p must not be running and nobody must be waiting for it.
+// ptable.lock must not be held.
+static void
+free_proc(struct proc* p)
+{
+  if (p->kstack) {
+    kfree(p->kstack);
+    p->kstack = 0;
+  }
+  if (p->mm) {
+    free_mm(replace_mm(p, 0));
+  }
+  // Out of pidhash before its task_group may go, see
+  // proc_priority().
+  acquire(&pidhash.lock);
+  list_del(&p->pid_list);
+  release(&pidhash.lock);
+  struct task_group* tg = p->tg;
+  acquire(&ptable.lock);
+  p->state = UNUSED;
+  list_del(&p->thread_group);
+  list_del(&p->siblings);
+  list_del(&p->list);
+  if (tg && --tg->users > 0) {
+    tg = 0;
+  }
+  release(&ptable.lock);
+  if (tg) {
+    kmem_cache_free(tg);
+  }
+  kmem_cache_free(p);
+}
+
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -84,15 +670,20 @@ allocproc(void)
   INIT_LIST_HEAD(&p->children);
   INIT_LIST_HEAD(&p->siblings);
   INIT_LIST_HEAD(&p->thread_group);
+  INIT_LIST_HEAD(&p->run_list);
+  INIT_LIST_HEAD(&p->wait_list);
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->cpus_allowed = ~0;
   release(&ptable.lock);
 
+  acquire(&pidhash.lock);
+  list_add(&p->pid_list, &pidhash.buckets[p->pid % NPIDHASH]);
+  release(&pidhash.lock);
+
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
-    list_del(&p->list);
-    kmem_cache_free(p);
+    free_proc(p);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -192,6 +783,11 @@ free_mm(struct mm_struct* mm)
     mm->pgdir = 0;
     mm->sz = 0;
     release(&mm->lock);
+    if (mm->exe) {
+      begin_trans();
+      iput(mm->exe);
+      commit_trans();
+    }
     kmem_cache_free(mm);
   } else {
     release(&mm->lock);
@@ -209,6 +805,8 @@ setup_mm(void)
   mm->users = 1;
   mm->pgdir = setupkvm();
   mm->sz = PGSIZE;
+  mm->exe = 0;
+  mm->nregion = 0;
   INIT_LIST_HEAD(&mm->mmap_list);
   if (!mm->pgdir) {
     free_mm(mm);
@@ -263,6 +861,13 @@ copy_mm(unsigned int clone_flags, struct proc* p)
   if (!p->mm) return 0;
   if (clone_flags & CLONE_VM) {
     acquire(&p->mm->lock);
+    // See unsharecow().  A vfork parent sleeps until the child is
+    // gone from its memory, so their TLBs can't disagree.
+    if (p->mm->users == 1 && !(clone_flags & CLONE_VFORK) &&
+        unsharecow(p->mm->pgdir, p->mm->sz) < 0) {
+      release(&p->mm->lock);
+      return -ENOMEM;
+    }
     p->mm->users++;
     release(&p->mm->lock);
     return 0;
@@ -273,14 +878,24 @@ copy_mm(unsigned int clone_flags, struct proc* p)
   initlock(&mm->mmap_list_lock, "proc->mmap_list");
   INIT_LIST_HEAD(&mm->mmap_list);
   mm->users = 1;
+  mm->exe = 0;
+  mm->nregion = 0;
   acquire(&p->mm->lock);
-  mm->pgdir = copyuvm(p->mm->pgdir, p->mm->sz);
+  // Only share pages copy-on-write when no other thread could
+  // be writing to them through a stale TLB entry.
+  mm->pgdir = copyuvm(p->mm->pgdir, p->mm->sz, p->mm->users == 1);
   if (mm->pgdir == 0) {
     release(&p->mm->lock);
     free_mm(mm);
     return -ENOMEM;
   }
   mm->sz = p->mm->sz;
+  // Pages not read in yet are left out by copyuvm(): the child
+  // reads them from the same regions.
+  if (p->mm->exe)
+    mm->exe = idup(p->mm->exe);
+  mm->nregion = p->mm->nregion;
+  memmove(mm->region, p->mm->region, sizeof(mm->region));
   // Copy mmaps
   struct list_head* list;
   acquire(&p->mm->mmap_list_lock);
@@ -387,6 +1002,66 @@ free_fs_info(struct fs_info_struct* fs_info)
   }
 }
 
+// Create a process that runs fn in the kernel and never
+// returns to user space.  fn is entered holding cpu->rq.lock
+// (see forkret) and must release it first.
+struct proc*
+kthread_create(char* name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return 0;
+  if((p->tg = alloc_task_group(0)) == 0){
+    free_proc(p);
+    return 0;
+  }
+  p->context->eip = (uint)fn;
+  p->group_leader = p;
+  p->tgid = p->pid;
+  p->detached = 1;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  make_runnable(p);
+  release(&ptable.lock);
+  return p;
+}
+
+// Free exited detached processes, so that page table teardown
+// and the rest of the cleanup don't run in scheduler() or exit().
+static void
+reaper(void)
+{
+  struct proc *p;
+
+  // Still holding cpu->rq.lock from scheduler.
+  release(&cpu->rq.lock);
+
+  acquire(&reaplist.lock);
+  for(;;){
+    while(list_empty(&reaplist.list))
+      sleep(&reaplist, &reaplist.lock);
+    p = list_entry(reaplist.list.next, struct proc, run_list);
+    list_del_init(&p->run_list);
+    release(&reaplist.lock);
+
+    // It may still be switching away on its last CPU.
+    while(p->on_cpu)
+      ;
+    free_proc(p);
+
+    acquire(&reaplist.lock);
+  }
+}
+
+void
+reaperinit(void)
+{
+  if(kthread_create("reaper", reaper) == 0)
+    panic("reaperinit");
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -397,6 +1072,8 @@ userinit(void)
   
   p = allocproc();
   initproc = p;
+  if((p->tg = alloc_task_group(0)) == 0)
+    panic("userinit: out of memory?");
   if((p->mm = setup_mm()) == 0)
     panic("userinit: out of memory?");
   inituvm(p->mm->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
@@ -429,7 +1106,9 @@ userinit(void)
   p->gid = 0;
   p->egid = 0;
 
-  p->state = RUNNABLE;
+  acquire(&ptable.lock);
+  make_runnable(p);
+  release(&ptable.lock);
 }
 
 // Grow current process's memory by n bytes.
@@ -441,19 +1120,32 @@ growproc(int n)
   
   sz = proc->mm->sz;
   if(n > 0){
-    if((sz = allocuvm(proc->mm->pgdir, sz, sz + n, PTE_W | PTE_U)) == 0)
+    // The pages are only promised: pagein() supplies them zeroed
+    // when they are first touched.
+    if(sz + n < sz || sz + n >= KERNBASE)
       return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(proc->mm->pgdir, sz, sz + n)) == 0)
       return -1;
+    // Pages given back must come back zeroed, not from the file.
+    for(struct mm_region* r = proc->mm->region;
+        r < proc->mm->region + proc->mm->nregion; r++){
+      if(r->end > PGROUNDUP(sz))
+        r->end = PGROUNDUP(sz);
+    }
   }
   proc->mm->sz = sz;
   switchuvm(proc);
   return 0;
 }
 
-int
-clone(void* child_stack, unsigned int clone_flags)
+// Create a child of the current process, as directed by clone_flags.
+// With start set, the child runs start(arg) in the kernel before it
+// first returns to user space, see spawnret().
+static int
+copy_process(void* child_stack, unsigned int clone_flags, uint tls,
+    uint ctid, int (*start)(void*), void* arg)
 {
   int pid;
   struct proc *np;
@@ -461,33 +1153,37 @@ clone(void* child_stack, unsigned int clone_flags)
   // Allocate process.
   if((np = allocproc()) == 0)
     return -ENOMEM;
+  // Threads share the accounting of their group (see below),
+  // a new process starts where its parent is.
+  if (!(clone_flags & CLONE_THREAD) &&
+      (np->tg = alloc_task_group(proc->tg->vruntime)) == 0) {
+    free_proc(np);
+    return -ENOMEM;
+  }
 
   int retval;
   np->mm = proc->mm;
   if ((retval = copy_mm(clone_flags, np)) < 0) {
     np->mm = 0;
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+    free_proc(np);
     return retval;
   }
   np->files = proc->files;
   if ((retval = copy_files(clone_flags, np)) < 0) {
-    free_mm(np->mm);
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+    free_proc(np);
     return retval;
   }
   np->fs = proc->fs;
   if ((retval = copy_fs_info(clone_flags, np)) < 0) {
-    free_mm(np->mm);
     free_files(np->files);
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+    free_proc(np);
     return retval;
   }
+  if (start) {
+    np->start = start;
+    np->start_arg = arg;
+    np->context->eip = (uint)spawnret;
+  }
   if (clone_flags & (CLONE_THREAD | CLONE_PARENT)) {
     np->parent = proc->parent;
   } else {
@@ -504,9 +1200,20 @@ clone(void* child_stack, unsigned int clone_flags)
   np->gid = proc->gid;
   np->egid = proc->egid;
   np->sgid = proc->sgid;
+  np->nice = proc->nice;
+  np->cpus_allowed = proc->cpus_allowed;
   if (child_stack) {
     np->tf->esp = (uint)child_stack;
   }
+  np->tls = proc->tls;
+  if (clone_flags & CLONE_SETTLS) {
+    np->tls = tls;
+    np->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+  }
+  np->clear_child_tid = 0;
+  if (clone_flags & CLONE_CHILD_CLEARTID) {
+    np->clear_child_tid = ctid;
+  }
   if (clone_flags & CLONE_THREAD) {
     np->detached = 1;
   } else {
@@ -525,19 +1232,79 @@ clone(void* child_stack, unsigned int clone_flags)
     np->groups[i] = proc->groups[i];
   }
 
+  np->last_cpu = cpu - cpus;
+  pid = np->pid;
+  safestrcpy(np->name, proc->name, sizeof(proc->name));
+
   acquire(&ptable.lock);
   if (clone_flags & CLONE_THREAD) {
     list_add_tail(&np->thread_group, &proc->thread_group);
+    np->tg = proc->tg;
+    np->tg->users++;
   }
   list_add_tail(&np->siblings, &np->parent->children);
+  if (clone_flags & CLONE_VFORK) {
+    np->vfork_parent = proc;
+    proc->vfork_done = 0;
+  }
+  make_runnable(np);
+  // The child may be running on our stack: don't return to user
+  // space before it has left our memory.  Being killed doesn't
+  // cut this short, the child still points at us.
+  if (clone_flags & CLONE_VFORK) {
+    while (!proc->vfork_done)
+      sleep(&proc->vfork_done, &ptable.lock);
+  }
   release(&ptable.lock);
 
-  pid = np->pid;
-  np->state = RUNNABLE;
-  safestrcpy(np->name, proc->name, sizeof(proc->name));
   return pid;
 }
 
+int
+clone(void* child_stack, unsigned int clone_flags, uint tls, uint ctid)
+{
+  return copy_process(child_stack, clone_flags, tls, ctid, 0, 0);
+}
+
+// Start a child that borrows our memory to run start(arg) in the
+// kernel, and wait until it is done with it.  start() should exec
+// a new image and return 0, or return an error and the child exits
+// quietly, without ever being seen by wait().  Either way the child
+// has been created and its pid is returned.
+int
+spawn(int (*start)(void*), void* arg)
+{
+  return copy_process(0, CLONE_VM | CLONE_VFORK, 0, 0, start, arg);
+}
+
+// A child made by spawn() starts here instead of forkret(),
+// and returns to trapret the same way.
+static void
+spawnret(void)
+{
+  forkret();
+  if (proc->start(proc->start_arg) < 0) {
+    acquire(&ptable.lock);
+    proc->detached = 1;
+    release(&ptable.lock);
+    exit();
+  }
+}
+
+// Let a parent sleeping in a CLONE_VFORK clone() go, once we no
+// longer use its memory: after exec, or at exit.
+void
+vfork_release(void)
+{
+  if (proc->vfork_parent == 0)
+    return;
+  acquire(&ptable.lock);
+  proc->vfork_parent->vfork_done = 1;
+  wakeup(&proc->vfork_parent->vfork_done);
+  proc->vfork_parent = 0;
+  release(&ptable.lock);
+}
+
 // Exit the specified process.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited (unless it was detached).
@@ -550,6 +1317,25 @@ exit(void)
   if(proc == initproc)
     panic("init exiting");
 
+  if (proc->policy == SCHED_DEADLINE) {
+    acquire(&dl_lock);
+    cpus[proc->dl_cpu].rq.dl_bw -= proc->dl_bw;
+    release(&dl_lock);
+    proc->policy = SCHED_NORMAL;
+  }
+
+  // Tell whoever waits for this thread that its stack is no
+  // longer in use.
+  if (proc->clear_child_tid) {
+    int zero = 0;
+    if (copyout(proc->mm->pgdir, proc->clear_child_tid, &zero,
+          sizeof(zero)) == 0) {
+      futex_wake(proc->clear_child_tid, 1);
+    }
+  }
+
+  vfork_release();
+
   // Close all open files.
   free_files(proc->files);
   free_fs_info(proc->fs);
@@ -562,7 +1348,7 @@ exit(void)
 
   // Parent might be sleeping in wait().
   if (!proc->detached) {
-    wakeup1(proc->parent);
+    wakeup(proc->parent);
   }
 
   // Pass abandoned children to init.
@@ -570,21 +1356,27 @@ exit(void)
 
   list_for_each_safe(pos, next, &proc->children) {
     p = list_entry(pos, struct proc, siblings);
-    list_del(pos);
+    list_del_init(pos);
     if (p->state == UNUSED) continue;
     p->parent = initproc;
     list_add_tail(pos, &initproc->children);
     if (p->state == ZOMBIE && !p->detached)
-      wakeup1(initproc);
+      wakeup(initproc);
   }
 
   if (!proc->detached) {
     proc->state = ZOMBIE;
   } else {
-    // Free the process, nobody should wait for it.
+    // Let the reaper free the process, nobody should wait for it.
     proc->state = UNUSED;
+    acquire(&reaplist.lock);
+    list_add_tail(&proc->run_list, &reaplist.list);
+    release(&reaplist.lock);
+    wakeup(&reaplist);
   }
   // Jump into the scheduler, never to return.
+  acquire(&cpu->rq.lock);
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -596,8 +1388,7 @@ kill_other_threads_in_group(void)
   struct proc* p;
   list_for_each_entry(p, &proc->thread_group, thread_group) {
     p->killed = 1;
-    if(p->state == SLEEPING)
-      p->state = RUNNABLE;
+    wakeup_proc(p);
   }
   release(&ptable.lock);
 }
@@ -630,21 +1421,13 @@ wait(void)
       if(p->state == ZOMBIE){
         // Found one.
         list_del_init(pos);
+        // exit() drops ptable.lock before switching away,
+        // so it may still be running on its kernel stack.
+        while(p->on_cpu)
+          ;
         release(&ptable.lock);
         pid = p->pid;
-        if (p->kstack) {
-          kfree(p->kstack);
-          p->kstack = 0;
-        }
-        if (p->mm) {
-          free_mm(p->mm);
-          p->mm = 0;
-        }
-        p->state = UNUSED;
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
+        free_proc(p);
         return pid;
       }
     }
@@ -655,7 +1438,7 @@ wait(void)
       return -ECHILD;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wakeup call in exit.)
     sleep(proc, &ptable.lock);  //DOC: wait-sleep
   }
 }
@@ -664,7 +1447,8 @@ wait(void)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take a process from this CPU's runqueue,
+//      or steal one from another CPU if it is empty
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -672,66 +1456,59 @@ void
 scheduler(void)
 {
   struct proc *p;
+  struct runqueue *rq = &cpu->rq;
 
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    struct list_head *pos;
-    // We can’t use list_for_each_safe here, I don’t quite understand
-    // why, but I have spent around ten hours debugging this,
-    // so you’d better trust me.
-    list_for_each(pos, &ptable.list) {
-      p = list_entry(pos, struct proc, list);
-      if (p->state == UNUSED) {
-        if (p->kstack != 0) {
-          kfree(p->kstack);
-          p->kstack = 0;
-        }
-        if (p->mm != 0) {
-          free_mm(p->mm);
-          p->mm = 0;
-        }
-        struct list_head* prev = pos;
-        pos = pos->prev;
-        list_del(&p->thread_group);
-        list_del(&p->siblings);
-        list_del(prev);
-        kmem_cache_free(list_entry(prev, struct proc, list));
+    acquire(&rq->lock);
+    p = rq_dequeue(rq);
+    if(p == 0){
+      release(&rq->lock);
+      if((p = steal_proc()) == 0){
+        idle();
         continue;
       }
-      if (p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-      swtch(&cpu->scheduler, proc->context);
-      switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      proc = 0;
+      acquire(&rq->lock);
     }
-    release(&ptable.lock);
 
+    // A process woken up right after it went to sleep can be
+    // queued before its old CPU has finished switching away from it.
+    while(p->on_cpu)
+      ;
+
+    // Switch to chosen process.  It is the process's job
+    // to release rq->lock and then reacquire it
+    // before jumping back to us.
+    proc = p;
+    p->on_cpu = 1;
+    if(p->last_cpu != cpu - cpus){
+      cpu->migrations++;
+      p->last_cpu = cpu - cpus;
+    }
+    switchuvm(p);
+    p->state = RUNNING;
+    swtch(&cpu->scheduler, proc->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    proc = 0;
+    p->on_cpu = 0;
+    release(&rq->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only cpu->rq.lock
 // and have changed proc->state.
 void
 sched(void)
 {
   int intena;
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&cpu->rq.lock))
+    panic("sched rq.lock");
   if(cpu->ncli != 1)
     panic("sched locks");
   if(proc->state == RUNNING)
@@ -747,10 +1524,15 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
+  if(!cpu_allowed(proc, cpu - cpus)){
+    requeue_self();
+    return;
+  }
+  acquire(&cpu->rq.lock);  //DOC: yieldlock
   proc->state = RUNNABLE;
+  rq_enqueue(&cpu->rq, proc);
   sched();
-  release(&ptable.lock);
+  release(&cpu->rq.lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -759,8 +1541,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding cpu->rq.lock from scheduler.
+  release(&cpu->rq.lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -773,67 +1555,163 @@ forkret(void)
   // Return to "caller", actually trapret (see allocproc).
 }
 
-// Atomically release lock and sleep on chan.
+static struct waitqueue*
+waitqueue_for(void *chan)
+{
+  // Multiplicative hash: channels are often page-aligned
+  // (pipes) or close together (buffers), so mix in the high bits.
+  return &waitqueues[((uint)chan * 2654435761u) >> (32 - WAITQ_SHIFT)];
+}
+
+// Atomically release lock and sleep on chan,
+// and until t expires if t is not 0.
 // Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+static void
+sleep_on(void *chan, struct spinlock *lk, struct timeout *t, uint expires)
 {
+  struct waitqueue *wq;
+
   if(proc == 0)
     panic("sleep");
 
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // Must acquire the waitqueue lock in order to
+  // change p->state.
+  // Once we hold it, we can be guaranteed that
+  // we won't miss any wakeup (wakeup runs with
+  // the waitqueue of chan locked),
   // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  wq = waitqueue_for(chan);
+  acquire(&wq->lock);  //DOC: sleeplock1
+  release(lk);
 
-  // Go to sleep.
+  // Go to sleep.  sched() wants our runqueue locked instead;
+  // a wakeup that comes after wq->lock is released will
+  // wait for on_cpu before running us anywhere.
   proc->chan = chan;
   proc->state = SLEEPING;
+  list_add_tail(&proc->wait_list, &wq->list);
+  // The timeout runs without the timeout lock held, and waits
+  // for wq->lock in wakeup_proc() if it expires right away.
+  if(t)
+    timeout_add(t, expires);
+  acquire(&cpu->rq.lock);
+  release(&wq->lock);
   sched();
+  release(&cpu->rq.lock);
 
   // Tidy up.
   proc->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);  //DOC: sleeplock2
+}
+
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleep_on(chan, lk, 0, 0);
 }
 
-//PAGEBREAK!
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
 static void
-wakeup1(void *chan)
+sleep_expired(void *arg)
 {
-  struct proc *p;
+  wakeup_proc(arg);
+}
 
-  /*for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)*/
+// Like sleep(), but wake up after at most n ticks.
+// Returns -ETIMEDOUT if it was the timeout that woke us up,
+// else 0, and the caller should check its condition again.
+int
+sleep_timeout(void *chan, struct spinlock *lk, uint n)
+{
+  struct timeout t;
+
+  timeout_init(&t, sleep_expired, proc);
+  sleep_on(chan, lk, &t, ticks + n);
+  if(timeout_del(&t))
+    return 0;
+  return -ETIMEDOUT;
+}
+
+// Make p, which was SLEEPING, runnable again.
+// The wq->lock of its channel must be held.
+static void
+wake(struct proc* p)
+{
+  // It slept before using up its slice, e.g. waiting for I/O.
+  if (p->level > 0)
+    p->level--;
+  p->slice_ticks = 0;
+  make_runnable(p);
+}
+
+//PAGEBREAK!
+// Wake up at most n processes sleeping on chan, in the order
+// they went to sleep, and return how many were woken up.
+// Only the processes hashed to the same waitqueue are looked at.
+int
+wakeup_n(void *chan, int n)
+{
+  struct waitqueue *wq = waitqueue_for(chan);
   struct list_head *pos, *next;
-  list_for_each_safe(pos, next, &ptable.list) {
-    p = list_entry(pos, struct proc, list);
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  int woken = 0;
+
+  acquire(&wq->lock);
+  list_for_each_safe(pos, next, &wq->list) {
+    if(woken == n)
+      break;
+    struct proc *p = list_entry(pos, struct proc, wait_list);
+    if(p->chan == chan){
+      list_del_init(pos);
+      wake(p);
+      woken++;
+    }
   }
+  release(&wq->lock);
+  return woken;
 }
 
 // Wake up all processes sleeping on chan.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  wakeup_n(chan, -1);
+}
+
+// Wake p up if it is sleeping, whatever it sleeps on.
+// p must not be freed meanwhile (hold ptable.lock or pidhash.lock,
+// or have p wait for the call, as sleep_timeout() does).
+static void
+wakeup_proc(struct proc* p)
+{
+  void *chan = p->chan;
+  if(p->state != SLEEPING || chan == 0)
+    return;
+  struct waitqueue *wq = waitqueue_for(chan);
+  acquire(&wq->lock);
+  // Recheck, it might have been woken up in the meantime.
+  if(p->state == SLEEPING && p->chan == chan){
+    list_del_init(&p->wait_list);
+    wake(p);
+  }
+  release(&wq->lock);
+}
+
+// Find the process with the given pid in pidhash.
+// pidhash.lock must be held.
+static struct proc*
+find_proc(int pid)
+{
+  struct proc *p;
+
+  list_for_each_entry(p, &pidhash.buckets[(uint)pid % NPIDHASH], pid_list) {
+    if(p->pid == pid)
+      return p;
+  }
+  return 0;
 }
 
 struct proc*
@@ -841,17 +1719,78 @@ get_proc_by_pid(int pid)
 {
   struct proc *p;
 
-  acquire(&ptable.lock);
-  list_for_each_entry(p, &ptable.list, list) {
-    if(p->pid == pid){
-      release(&ptable.lock);
-      return p;
-    }
+  acquire(&pidhash.lock);
+  p = find_proc(pid);
+  release(&pidhash.lock);
+  return p;
+}
+
+// Size in bytes of the memory of the process with the given pid,
+// and how many of its pages are resident.  pidhash.lock keeps the
+// mm from being freed meanwhile, see replace_mm(), and the lock of
+// the mm keeps its page table as it is.  Returns -1 if there is no
+// such process.
+int
+proc_memory(int pid, uint* sz, uint* rss)
+{
+  struct proc *p;
+  struct mm_struct *mm;
+
+  acquire(&pidhash.lock);
+  if((p = find_proc(pid)) == 0){
+    release(&pidhash.lock);
+    return -1;
   }
-  release(&ptable.lock);
+  *sz = *rss = 0;
+  if((mm = p->mm) != 0){
+    acquire(&mm->lock);
+    *sz = mm->sz;
+    *rss = uvmrss(mm->pgdir, mm->sz);
+    release(&mm->lock);
+  }
+  release(&pidhash.lock);
   return 0;
 }
 
+// Copy what /proc/<pid>/priority shows of the process with the
+// given pid into *pp while pidhash.lock keeps it and its task_group
+// from being freed.  Returns -1 if there is no such process.
+int
+proc_priority(int pid, struct proc_priority* pp)
+{
+  struct proc *p;
+
+  acquire(&pidhash.lock);
+  if((p = find_proc(pid)) == 0){
+    release(&pidhash.lock);
+    return -1;
+  }
+  pp->nice = p->nice;
+  pp->level = p->level;
+  pp->vruntime = p->tg ? p->tg->vruntime : 0;
+  pp->policy = p->policy;
+  pp->dl_runtime = p->dl_runtime;
+  pp->dl_deadline = p->dl_deadline;
+  pp->dl_period = p->dl_period;
+  release(&pidhash.lock);
+  return 0;
+}
+
+// Make mm the memory of p and return the one it had, for the
+// caller to give up with free_mm().  Done under pidhash.lock so
+// that proc_memory() never looks at an mm that may be freed.
+struct mm_struct*
+replace_mm(struct proc* p, struct mm_struct* mm)
+{
+  struct mm_struct* old;
+
+  acquire(&pidhash.lock);
+  old = p->mm;
+  p->mm = mm;
+  release(&pidhash.lock);
+  return old;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -860,29 +1799,250 @@ kill(int pid)
 {
   struct proc *p;
 
-  acquire(&ptable.lock);
-  struct list_head *pos, *next;
-  list_for_each_safe(pos, next, &ptable.list) {
-    p = list_entry(pos, struct proc, list);
-    if(p->pid == pid){
-      if (proc->euid != 0 &&
-          proc->uid != p->uid &&
-          proc->uid != p->suid &&
-          proc->euid != p->uid &&
-          proc->euid != p->suid) {
-        release(&ptable.lock);
-        return -EPERM;
-      }
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
-      return 0;
+  acquire(&pidhash.lock);
+  if((p = find_proc(pid)) == 0){
+    release(&pidhash.lock);
+    return -ESRCH;
+  }
+  if (proc->euid != 0 &&
+      proc->uid != p->uid &&
+      proc->uid != p->suid &&
+      proc->euid != p->uid &&
+      proc->euid != p->suid) {
+    release(&pidhash.lock);
+    return -EPERM;
+  }
+  p->killed = 1;
+  // Wake process from sleep if necessary.
+  wakeup_proc(p);
+  release(&pidhash.lock);
+  return 0;
+}
+
+// Give up the CPU and queue the current process wherever
+// select_cpu() says, which need not be this CPU.
+static void
+requeue_self(void)
+{
+  // From here on another CPU may pick it, but it won't run
+  // there until it is switched away from here (see on_cpu).
+  make_runnable(proc);
+  acquire(&cpu->rq.lock);
+  sched();
+  release(&cpu->rq.lock);
+}
+
+// Set the scheduling policy of the calling process.
+// Changing other processes is not supported, as they may be
+// queued on any CPU.
+// For SCHED_DEADLINE, pick the CPU with the least deadline
+// bandwidth admitted that can take the new process, or fail
+// with EBUSY if none can.
+int
+sched_setattr(int pid, struct sched_attr* attr)
+{
+  uint period = attr->sched_period;
+  uint bw = 0;
+
+  if (pid != 0 && pid != proc->pid)
+    return -EINVAL;
+  if (attr->sched_policy == SCHED_DEADLINE) {
+    if (period == 0)
+      period = attr->sched_deadline;
+    if (attr->sched_runtime == 0 ||
+        attr->sched_runtime > attr->sched_deadline ||
+        attr->sched_deadline > period ||
+        period > DL_PERIOD_MAX)
+      return -EINVAL;
+    bw = (attr->sched_runtime << DL_BW_SHIFT) / period;
+  } else if (attr->sched_policy != SCHED_NORMAL) {
+    return -EINVAL;
+  }
+
+  int n = ncpu > 0 ? ncpu : 1;
+  int best = -1;
+  acquire(&dl_lock);
+  if (proc->policy == SCHED_DEADLINE)
+    cpus[proc->dl_cpu].rq.dl_bw -= proc->dl_bw;
+  if (attr->sched_policy == SCHED_DEADLINE) {
+    for (int i = 0; i < n; ++i) {
+      if (!cpu_allowed(proc, i) || cpus[i].rq.dl_bw + bw > DL_BW_MAX)
+        continue;
+      if (best < 0 || cpus[i].rq.dl_bw < cpus[best].rq.dl_bw)
+        best = i;
     }
+    if (best < 0) {
+      if (proc->policy == SCHED_DEADLINE)
+        cpus[proc->dl_cpu].rq.dl_bw += proc->dl_bw;
+      release(&dl_lock);
+      return -EBUSY;
+    }
+    cpus[best].rq.dl_bw += bw;
   }
-  release(&ptable.lock);
-  return -ESRCH;
+  release(&dl_lock);
+
+  // A timer tick must not run sched_tick() on the new policy with
+  // the old parameters, or on a half-updated deadline job.
+  pushcli();
+  if (attr->sched_policy == SCHED_DEADLINE) {
+    proc->dl_runtime = attr->sched_runtime;
+    proc->dl_deadline = attr->sched_deadline;
+    proc->dl_period = period;
+    proc->dl_bw = bw;
+    proc->dl_cpu = best;
+    proc->dl_period_at = ticks;
+    dl_start_job(proc);
+  }
+  proc->policy = attr->sched_policy;
+  popcli();
+  if (proc->policy == SCHED_NORMAL) {
+    yield();
+    return 0;
+  }
+  requeue_self();
+  return 0;
+}
+
+int
+sched_getattr(int pid, struct sched_attr* attr)
+{
+  struct proc* p;
+
+  acquire(&pidhash.lock);
+  if (pid == 0) {
+    p = proc;
+  } else if ((p = find_proc(pid)) == 0) {
+    release(&pidhash.lock);
+    return -ESRCH;
+  }
+  attr->sched_policy = p->policy;
+  attr->sched_runtime = p->dl_runtime;
+  attr->sched_deadline = p->dl_deadline;
+  attr->sched_period = p->dl_period;
+  release(&pidhash.lock);
+  return 0;
+}
+
+// The CPUs that exist, as an affinity mask.
+static uint
+online_cpus(void)
+{
+  int n = ncpu > 0 ? ncpu : 1;
+  return n >= 32 ? ~0 : (1u << n) - 1;
+}
+
+// Restrict process pid (0 for the caller) to the CPUs in mask.
+// It takes effect when the process is next queued, or on the
+// next timer tick if it is running (see sched_tick()).
+// A deadline process has to keep the CPU it was admitted on.
+int
+sched_setaffinity(int pid, uint mask)
+{
+  struct proc* p;
+
+  mask &= online_cpus();
+  if (mask == 0)
+    return -EINVAL;
+  acquire(&pidhash.lock);
+  if (pid == 0) {
+    p = proc;
+  } else if ((p = find_proc(pid)) == 0) {
+    release(&pidhash.lock);
+    return -ESRCH;
+  }
+  if (proc->euid != 0 &&
+      proc->euid != p->uid &&
+      proc->euid != p->euid) {
+    release(&pidhash.lock);
+    return -EPERM;
+  }
+  if (p->policy == SCHED_DEADLINE && !((mask >> p->dl_cpu) & 1)) {
+    release(&pidhash.lock);
+    return -EBUSY;
+  }
+  p->cpus_allowed = mask;
+  release(&pidhash.lock);
+  if (p == proc && !cpu_allowed(proc, cpu - cpus))
+    yield();
+  return 0;
+}
+
+int
+sched_getaffinity(int pid, uint* mask)
+{
+  struct proc* p;
+
+  acquire(&pidhash.lock);
+  if (pid == 0) {
+    p = proc;
+  } else if ((p = find_proc(pid)) == 0) {
+    release(&pidhash.lock);
+    return -ESRCH;
+  }
+  *mask = p->cpus_allowed & online_cpus();
+  release(&pidhash.lock);
+  return 0;
+}
+
+// Find the target of getpriority() and setpriority().
+// pidhash.lock must be held.
+static struct proc*
+find_prio_target(int which, int who)
+{
+  if (which != PRIO_PROCESS)
+    return ERR_PTR(-EINVAL);
+  if (who == 0)
+    return proc;
+  struct proc* p = find_proc(who);
+  if (p == 0)
+    return ERR_PTR(-ESRCH);
+  return p;
+}
+
+// Return the nice value of a process.
+int
+getpriority(int which, int who, int* nice)
+{
+  acquire(&pidhash.lock);
+  struct proc* p = find_prio_target(which, who);
+  if (IS_ERR(p)) {
+    release(&pidhash.lock);
+    return PTR_ERR(p);
+  }
+  *nice = p->nice;
+  release(&pidhash.lock);
+  return 0;
+}
+
+// Set the nice value of a process, clamped to PRIO_MIN..PRIO_MAX.
+// Only root can change someone else's processes or lower nice.
+int
+setpriority(int which, int who, int nice)
+{
+  if (nice < PRIO_MIN)
+    nice = PRIO_MIN;
+  if (nice > PRIO_MAX)
+    nice = PRIO_MAX;
+  acquire(&pidhash.lock);
+  struct proc* p = find_prio_target(which, who);
+  if (IS_ERR(p)) {
+    release(&pidhash.lock);
+    return PTR_ERR(p);
+  }
+  if (proc->euid != 0 &&
+      proc->euid != p->uid &&
+      proc->euid != p->euid) {
+    release(&pidhash.lock);
+    return -EPERM;
+  }
+  if (proc->euid != 0 && nice < p->nice) {
+    release(&pidhash.lock);
+    return -EACCES;
+  }
+  // Takes effect the next time p is queued.
+  p->nice = nice;
+  release(&pidhash.lock);
+  return 0;
 }
 
 // addr must be page-aligned.
@@ -903,6 +2063,10 @@ mmap(void* addr, int length, int prot, int flags, struct file* file,
       return ERR_PTR(-EACCES);
     }
   }
+  // Heap pages not touched yet aren't in the page table.
+  if (pagein_range(proc->mm, (uint)addr, length) < 0) {
+    return ERR_PTR(-ENOMEM);
+  }
   for (current_length = 0; current_length < length;
       current_length += PGSIZE) {
     if (!set_pte_permissions(proc->mm->pgdir, addr + current_length,
@@ -925,7 +2089,7 @@ mmap(void* addr, int length, int prot, int flags, struct file* file,
   if ((flags & MAP_ANONYMOUS) == 0) {
     uint initial_offset = file->off;
     file->off = offset;
-    fileread(file, mmap->start, PGROUNDUP(length));
+    fileread(file, mmap->start, PGROUNDUP(length), 0);
     file->off = initial_offset;
   }
   uint permissions = PTE_P;
@@ -965,6 +2129,21 @@ handle_pagefault(uint address, uint err)
 {
   struct list_head* pos;
   int is_write = (err & 2);
+  if (proc == 0 || proc->mm == 0) {
+    return 0;
+  }
+  if (address < proc->mm->sz) {
+    pte_t* pte = walkpgdir(proc->mm->pgdir, (void*)address, 0);
+    // A page exec left to be read in on first touch.
+    if ((pte == 0 || !(*pte & PTE_P)) && pagein(proc->mm, address) == 0) {
+      return 1;
+    }
+    // Writing to a page shared copy-on-write after fork.
+    if (is_write && pte && (*pte & (PTE_P | PTE_U | PTE_COW)) ==
+        (PTE_P | PTE_U | PTE_COW)) {
+      return cowpage(proc->mm->pgdir, PGROUNDDOWN(address)) == 0;
+    }
+  }
   if (!is_write) {
     return 0;
   }
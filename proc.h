@@ -4,7 +4,32 @@
 #include "param.h"
 #include "mmap.h"
 // Segments in proc->gdt.
-#define NSEGS     7
+#define NSEGS     8
+
+// Number of priority levels of the multi-level feedback queue.
+// Level 0 runs first and has the shortest time slice.
+#define NPRIO     4
+
+// Per-CPU queue of RUNNABLE processes.
+struct runqueue {
+  struct spinlock lock;        // Held across swtch() into and out of scheduler
+  struct list_head queue[NPRIO]; // RUNNABLE processes, one list per level
+  int nr_running;              // Number of processes in all lists
+  uint boost;                  // Last priority boost applied, see rq_boost()
+  uint min_vruntime;           // Of the last task_group picked to run
+  uint min_uid_vruntime;       // Same for the groups of users
+  struct list_head dl;         // SCHED_DEADLINE processes, by deadline
+  struct list_head dl_throttled; // ... waiting for their next period
+  uint dl_bw;                  // Admitted bandwidth, under dl_lock in proc.c
+};
+
+// CPU time used by a set of processes, for fair sharing between
+// them and other sets.  Shared by the threads of a thread group;
+// there is also one per user, see uid_groups in proc.c.
+struct task_group {
+  volatile uint vruntime;      // Ticks used, plus catch-up on wakeup
+  int users;                   // Processes pointing here, under ptable.lock
+};
 
 // Per-CPU state
 struct cpu {
@@ -15,7 +40,13 @@ struct cpu {
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
-  
+  struct runqueue rq;          // Processes waiting to run on this CPU
+  volatile uint idle;          // Halted in scheduler(), waiting for an IPI
+  uint ticks;                  // Timer interrupts taken by this CPU
+  uint idle_ticks;             // ... of which arrived with no process running
+  uint wakeups;                // IPIs received to leave the idle loop
+  uint migrations;             // Processes it ran that last ran elsewhere
+
   // Cpu-local storage variables; see below
   struct cpu *cpu;
   struct proc *proc;           // The currently-running process.
@@ -74,6 +105,19 @@ struct mmap_list {
   struct mmap_struct* mmap;
 };
 
+// Part of the program that exec leaves to be read from its file
+// on first touch, see pagein().
+struct mm_region {
+  uint start;    // Page-aligned range of the pages it covers
+  uint end;
+  uint vaddr;    // Bytes [off, off+filesz) of the file go at vaddr,
+  uint off;      // the rest of the range is zero
+  uint filesz;
+  uint perm;     // PTE_U, and PTE_W if the segment is writable
+};
+
+#define NREGION 4
+
 struct mm_struct {
   pde_t* pgdir;  // Page table
   uint users;    // Number of links to the page table
@@ -81,6 +125,9 @@ struct mm_struct {
   struct list_head mmap_list; // List of mmaps
   struct spinlock lock;
   struct spinlock mmap_list_lock;
+  struct inode* exe;          // File the regions are read from
+  int nregion;
+  struct mm_region region[NREGION];
 };
 
 extern struct cache_info* mm_cache;
@@ -101,6 +148,18 @@ struct fs_info_struct {
 
 #define NGROUPS_MAX 16
 
+// Scheduling state of a process, as /proc/<pid>/priority shows
+// it, see proc_priority().
+struct proc_priority {
+  int nice;
+  int level;
+  uint vruntime;               // Of its thread group
+  int policy;
+  uint dl_runtime;             // SCHED_DEADLINE parameters, in ticks
+  uint dl_deadline;
+  uint dl_period;
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -132,6 +191,33 @@ struct proc {
   struct list_head thread_group; // List of processess in the same thread group
   int tgid;                    // Thread group ID
   int detached;                // Is thread detached?
+  uint tls;                    // Base of %gs in user mode, see tls.h
+  uint clear_child_tid;        // User address to zero and wake at exit
+  struct proc *vfork_parent;   // Sleeping until we exec or exit, see clone()
+  int vfork_done;              // Set when our CLONE_VFORK child lets us go
+  int (*start)(void*);         // For a child made by spawn(), to run in
+  void *start_arg;             // the kernel before it enters user space
+
+  struct list_head run_list;   // Link in a cpu's runqueue while RUNNABLE,
+                               // or in the reap list once exited
+  struct list_head wait_list;  // Link in a waitqueue while SLEEPING
+  struct list_head pid_list;   // Link in the pid hash
+  int last_cpu;                // Index in cpus[] of the CPU it last ran on
+  volatile int on_cpu;         // Context not yet saved by swtch()
+  int nice;                    // PRIO_MIN..PRIO_MAX, see resource.h
+  int level;                   // MLFQ level before nice is applied
+  int slice_ticks;             // Ticks used of the current time slice
+  struct task_group* tg;       // Accounting of the thread group
+  uint cpus_allowed;           // Bit i set if it may run on cpus[i]
+  int policy;                  // SCHED_NORMAL or SCHED_DEADLINE, see sched.h
+  uint dl_runtime;             // SCHED_DEADLINE parameters, in ticks
+  uint dl_deadline;
+  uint dl_period;
+  uint dl_bw;                  // dl_runtime / dl_period, fixed point
+  int dl_cpu;                  // CPU it was admitted on and is bound to
+  int dl_left;                 // Ticks left of the current job
+  uint dl_deadline_at;         // When the current job is due
+  uint dl_period_at;           // When the next job may start
 
   struct list_head list;
 };
@@ -7,6 +7,7 @@
 #include "stat.h"
 #include "err.h"
 #include "errno.h"
+#include "sched.h"
 
 static void
 itoa(char* dst, int value)
@@ -71,6 +72,8 @@ static int
 procfs_proc_file_pid_read(struct inode* ip, char* dst, uint off, uint n);
 static int
 procfs_proc_file_uid_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_proc_file_priority_read(struct inode* ip, char* dst, uint off, uint n);
 
 struct {
   char* name;
@@ -84,10 +87,41 @@ struct {
   { "memory", procfs_proc_file_memory_read },
   { "pid", procfs_proc_file_pid_read },
   { "uid", procfs_proc_file_uid_read },
+  { "priority", procfs_proc_file_priority_read },
 };
 
 #define N_PROC_ENTRIES (NELEM(procfs_proc_files_table) - 2 + 1)
-#define FREE_PAGES_INUM 2
+
+static int
+procfs_free_pages_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_buddyinfo_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_zeropool_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_cpustat_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_sched_group_read(struct inode* ip, char* dst, uint off, uint n);
+static int
+procfs_sched_group_write(struct inode* ip, char* src, uint off, uint n);
+
+// Files in the root of procfs, next to the process directories.
+// Their inode numbers start at 2 and must stay below N_PROC_ENTRIES,
+// which is the inode number of the first process directory.
+// Files without a write function are read-only.
+struct {
+  char* name;
+  int (*read)(struct inode*, char*, uint, uint);
+  int (*write)(struct inode*, char*, uint, uint);
+} procfs_root_files_table[] = {
+  { "free_pages", procfs_free_pages_read, 0 },
+  { "buddyinfo", procfs_buddyinfo_read, 0 },
+  { "zeropool", procfs_zeropool_read, 0 },
+  { "cpustat", procfs_cpustat_read, 0 },
+  { "sched_group", procfs_sched_group_read, procfs_sched_group_write },
+};
+
+#define ROOT_FILE_INUM(i) ((i) + 2)
 
 static int
 procfs_proc_file_write(struct inode* ip, char* dst, uint off, uint n)
@@ -217,16 +251,6 @@ procfs_proc_file_state_read(struct inode* ip, char* dst, uint off, uint n)
   return read_string(result, len, dst, off, n);
 }
 
-static int
-procfs_proc_file_memory_read(struct inode* ip, char* dst, uint off, uint n)
-{
-  struct proc* p = get_proc_by_pid(ip->inum / N_PROC_ENTRIES);
-  if (p == 0) return 0;
-  char result[16];
-  itoa(result, p->mm->sz);
-  int len = strlen(result);
-  return read_string(result, len, dst, off, n);
-}
 
 static int
 procfs_proc_file_pid_read(struct inode* ip, char* dst, uint off, uint n)
@@ -259,6 +283,157 @@ procfs_free_pages_read(struct inode* ip, char* dst, uint off, uint n)
   return read_string(result, len, dst, off, n);
 }
 
+static char*
+append_str(char* dst, char* src)
+{
+  while ((*dst = *src)) {
+    dst++;
+    src++;
+  }
+  return dst;
+}
+
+static char*
+append_int(char* dst, int value)
+{
+  itoa(dst, value);
+  return dst + strlen(dst);
+}
+
+// Size of the address space and how much of it is resident, in
+// bytes.  sbrk() and exec leave pages to be filled in on first
+// touch, so the second is usually much smaller.
+static int
+procfs_proc_file_memory_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  uint sz, rss;
+  if (proc_memory(ip->inum / N_PROC_ENTRIES, &sz, &rss) < 0) return 0;
+  char result[64];
+  char* end = append_str(result, "size ");
+  end = append_int(end, sz);
+  end = append_str(end, " resident ");
+  end = append_int(end, rss * PGSIZE);
+  return read_string(result, end - result, dst, off, n);
+}
+
+// Free blocks of each order in the page allocator, and the free
+// pages cached by the CPUs, which are counted in no block.  Many
+// free pages but no large blocks means memory is fragmented.
+static int
+procfs_buddyinfo_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  uint nfree[MAXORDER + 1];
+  int cached = buddyinfo(nfree);
+  char result[32 * (MAXORDER + 2)];
+  char* end = result;
+  for (int i = 0; i <= MAXORDER; i++) {
+    end = append_str(end, "order ");
+    end = append_int(end, i);
+    end = append_str(end, ": ");
+    end = append_int(end, nfree[i]);
+    end = append_str(end, "\n");
+  }
+  end = append_str(end, "cached: ");
+  end = append_int(end, cached);
+  end = append_str(end, "\n");
+  return read_string(result, end - result, dst, off, n);
+}
+
+// Pages zeroed in advance, and how many kalloc_zeroed() calls
+// found one (hits) or had to zero a page themselves (misses).
+static int
+procfs_zeropool_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  uint pages, hits, misses;
+  zeropoolinfo(&pages, &hits, &misses);
+  char result[64];
+  char* end = append_str(result, "pages ");
+  end = append_int(end, pages);
+  end = append_str(end, " hits ");
+  end = append_int(end, hits);
+  end = append_str(end, " misses ");
+  end = append_int(end, misses);
+  end = append_str(end, "\n");
+  return read_string(result, end - result, dst, off, n);
+}
+
+// Nice value, scheduler level and CPU time of the thread group,
+// see proc_prio() and pick_fair() in proc.c.
+static int
+procfs_proc_file_priority_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  struct proc_priority pp;
+  if (proc_priority(ip->inum / N_PROC_ENTRIES, &pp) < 0) return 0;
+  char result[128];
+  char* end = append_str(result, "nice ");
+  end = append_int(end, pp.nice);
+  end = append_str(end, " level ");
+  end = append_int(end, pp.level);
+  end = append_str(end, " vruntime ");
+  end = append_int(end, pp.vruntime);
+  if (pp.policy == SCHED_DEADLINE) {
+    end = append_str(end, " runtime ");
+    end = append_int(end, pp.dl_runtime);
+    end = append_str(end, " deadline ");
+    end = append_int(end, pp.dl_deadline);
+    end = append_str(end, " period ");
+    end = append_int(end, pp.dl_period);
+  }
+  return read_string(result, end - result, dst, off, n);
+}
+
+// What the scheduler shares CPU time fairly between:
+// "tgid" for thread groups, "uid" for users first, then their
+// thread groups.  Only root can write it (see the mode above).
+static int
+procfs_sched_group_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  char* result = sched_group_by_uid ? "uid" : "tgid";
+  return read_string(result, strlen(result), dst, off, n);
+}
+
+static int
+procfs_sched_group_write(struct inode* ip, char* src, uint off, uint n)
+{
+  if (n >= 3 && strncmp(src, "uid", 3) == 0) {
+    sched_group_by_uid = 1;
+  } else if (n >= 4 && strncmp(src, "tgid", 4) == 0) {
+    sched_group_by_uid = 0;
+  } else {
+    return -EINVAL;
+  }
+  return n;
+}
+
+// One line per CPU: timer ticks it has seen, how many of them
+// it was idle for, how many times it was woken by an IPI and how
+// many processes it took over from other CPUs.
+#define CPUSTAT_LINE 96  // Longest line, with four ten-digit counts
+
+static int
+procfs_cpustat_read(struct inode* ip, char* dst, uint off, uint n)
+{
+  char* result = kmalloc(ncpu * CPUSTAT_LINE, 0);
+  if (result == 0) return -ENOMEM;
+  char* end = result;
+  for (int i = 0; i < ncpu; ++i) {
+    if (i > 0) end = append_str(end, "\n");
+    end = append_str(end, "cpu");
+    end = append_int(end, i);
+    end = append_str(end, " ticks ");
+    end = append_int(end, cpus[i].ticks);
+    end = append_str(end, " idle ");
+    end = append_int(end, cpus[i].idle_ticks);
+    end = append_str(end, " wakeups ");
+    end = append_int(end, cpus[i].wakeups);
+    end = append_str(end, " migrations ");
+    end = append_int(end, cpus[i].migrations);
+  }
+  int count = read_string(result, end - result, dst, off, n);
+  kmfree(result);
+  return count;
+}
+
 static void
 init_procfs_proc_dir(struct inode* ip);
 
@@ -306,14 +481,19 @@ init_procfs_proc_dir(struct inode* ip)
 }
 
 static void
-init_procfs_free_pages(struct inode* ip)
+init_procfs_root_file(struct inode* ip, int i)
 {
-  ip->ops.read = procfs_free_pages_read;
-  ip->ops.write = procfs_inode_write;
+  ip->ops.read = procfs_root_files_table[i].read;
   ip->ops.update = procfs_inode_update;
   ip->size = 0;
   ip->flags = I_VALID;
-  ip->mode = (0444 | S_IFREG);
+  if (procfs_root_files_table[i].write) {
+    ip->ops.write = procfs_root_files_table[i].write;
+    ip->mode = (0644 | S_IFREG);
+  } else {
+    ip->ops.write = procfs_inode_write;
+    ip->mode = (0444 | S_IFREG);
+  }
   ip->uid = 0;
   ip->gid = 0;
   ip->additional_info = (void*)1;
@@ -363,11 +543,13 @@ procfs_root_read(struct inode* ip, char* dst, uint off, uint n)
     off -= sizeof(struct dirent);
   }
 
-  strncpy(entry.name, "free_pages", 11);
-  entry.inum = FREE_PAGES_INUM;
-  read_str((char*)&entry, sizeof(struct dirent), &dst, &off, n, &written);
-  if (off >= sizeof(struct dirent)) {
-    off -= sizeof(struct dirent);
+  for (int i = 0; i < NELEM(procfs_root_files_table); ++i) {
+    strncpy(entry.name, procfs_root_files_table[i].name, DIRSIZ);
+    entry.inum = ROOT_FILE_INUM(i);
+    read_str((char*)&entry, sizeof(struct dirent), &dst, &off, n, &written);
+    if (off >= sizeof(struct dirent)) {
+      off -= sizeof(struct dirent);
+    }
   }
 
   return written;
@@ -389,30 +571,26 @@ procfs_root_lookup(struct inode* ip, char* name, uint* poff)
   }
   uint pid = atoi(name, 10);
   if (pid == 0) {
-    if (namecmp(name, "free_pages") == 0) {
-      struct filesystem* fs = find_fs(PROCDEV);
-      struct inode* node = iget(fs, FREE_PAGES_INUM);
-      init_procfs_free_pages(node);
-      return node;
+    for (int i = 0; i < NELEM(procfs_root_files_table); ++i) {
+      if (namecmp(name, procfs_root_files_table[i].name) == 0) {
+        struct filesystem* fs = find_fs(PROCDEV);
+        struct inode* node = iget(fs, ROOT_FILE_INUM(i));
+        init_procfs_root_file(node, i);
+        return node;
+      }
     }
     if (namecmp(name, "self") != 0) {
       return ERR_PTR(-ENOENT);
     }
     pid = proc->pid;
   }
-  acquire(&ptable.lock);
-  struct proc* p;
-  list_for_each_entry(p, &ptable.list, list) {
-    if (p->pid == pid) {
-      struct filesystem* fs = find_fs(PROCDEV);
-      struct inode* node = iget(fs, pid * N_PROC_ENTRIES);
-      init_procfs_proc_dir(node);
-      release(&ptable.lock);
-      return node;
-    }
+  if (get_proc_by_pid(pid) == 0) {
+    return ERR_PTR(-ENOENT);
   }
-  release(&ptable.lock);
-  return ERR_PTR(-ENOENT);
+  struct filesystem* fs = find_fs(PROCDEV);
+  struct inode* node = iget(fs, pid * N_PROC_ENTRIES);
+  init_procfs_proc_dir(node);
+  return node;
 }
 
 int
@@ -98,10 +98,8 @@ main()
   struct dirent de;
   printf(1, "PID\tPPID\tUSER\tNAME\tSTATE\n");
   while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-    if (strcmp(".", de.name) == 0 ||
-        strcmp("..", de.name) == 0 ||
-        strcmp("self", de.name) == 0 ||
-        strcmp("free_pages", de.name) == 0) {
+    // Skip ".", "..", "self" and the files that are not processes.
+    if (de.name[0] < '0' || de.name[0] > '9') {
       continue;
     }
     char ppid[10];
@@ -0,0 +1,12 @@
+/*
+ * which argument of getpriority() and setpriority():
+ */
+#define PRIO_PROCESS 0 /* who is a pid, 0 for the calling process */
+#define PRIO_PGRP    1 /* not supported */
+#define PRIO_USER    2 /* not supported */
+
+/*
+ * range of nice values; lower runs first:
+ */
+#define PRIO_MIN (-20)
+#define PRIO_MAX 19
@@ -0,0 +1,19 @@
+/*
+ * scheduling policies, see sched_setattr():
+ */
+#define SCHED_NORMAL   0 /* multi-level feedback queue, the default */
+#define SCHED_DEADLINE 6 /* earliest deadline first, ahead of the others */
+
+/*
+ * Argument of sched_setattr() and sched_getattr().
+ * Times are in timer ticks.  A SCHED_DEADLINE process gets
+ * sched_runtime ticks of CPU every sched_period ticks, within
+ * sched_deadline ticks of the start of the period.
+ * A sched_period of 0 means the same as sched_deadline.
+ */
+struct sched_attr {
+  uint sched_policy;
+  uint sched_runtime;
+  uint sched_deadline;
+  uint sched_period;
+};
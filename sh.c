@@ -3,6 +3,7 @@
 #include "types.h"
 #include "user.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -50,14 +51,17 @@ struct backcmd {
 };
 
 int fork1(void);  // Fork but panics on failure.
+int spawncmd(struct cmd*, posix_spawn_file_actions_t*);
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
 {
   int p[2];
+  posix_spawn_file_actions_t fa;
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -91,7 +95,7 @@ runcmd(struct cmd *cmd)
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
+    if(spawncmd(lcmd->left, 0) < 0 && fork1() == 0)
       runcmd(lcmd->left);
     wait();
     runcmd(lcmd->right);
@@ -101,14 +105,22 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, p[1], 1);
+    posix_spawn_file_actions_addclose(&fa, p[0]);
+    posix_spawn_file_actions_addclose(&fa, p[1]);
+    if(spawncmd(pcmd->left, &fa) < 0 && fork1() == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, p[0], 0);
+    posix_spawn_file_actions_addclose(&fa, p[0]);
+    posix_spawn_file_actions_addclose(&fa, p[1]);
+    if(spawncmd(pcmd->right, &fa) < 0 && fork1() == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -123,13 +135,47 @@ runcmd(struct cmd *cmd)
     
   case BACK:
     bcmd = (struct backcmd*)cmd;
-    if(fork1() == 0)
+    if(spawncmd(bcmd->cmd, 0) < 0 && fork1() == 0)
       runcmd(bcmd->cmd);
     break;
   }
   exit();
 }
 
+// Start a simple command, a program with redirections around it,
+// with posix_spawnp() instead of a copy of the shell, doing the
+// file actions in fa first.  Returns its pid, 0 if it couldn't be
+// started, or -1 if cmd is anything else and needs a shell of its
+// own.
+int
+spawncmd(struct cmd *cmd, posix_spawn_file_actions_t *fa)
+{
+  posix_spawn_file_actions_t actions;
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  int pid;
+
+  if(fa)
+    actions = *fa;
+  else
+    posix_spawn_file_actions_init(&actions);
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if(posix_spawn_file_actions_addopen(&actions, rcmd->fd, rcmd->file,
+                                        rcmd->mode, 0666) != 0)
+      return -1;
+  }
+  ecmd = (struct execcmd*)cmd;
+  if(cmd->type != EXEC || ecmd->argv[0] == 0)
+    return -1;
+  if(posix_spawnp(&pid, ecmd->argv[0], &actions, 0, ecmd->argv,
+                  environ) != 0){
+    printf(2, "exec %s failed\n", ecmd->argv[0]);
+    return 0;
+  }
+  return pid;
+}
+
 int str_to_int(char* str, int base, int* result)
 {
   int current = 0;
@@ -170,7 +216,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, pid;
   
   // Assumes three file descriptors open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -209,9 +256,13 @@ main(void)
       umask(new_value);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf + index));
-    wait();
+    if((cmd = parsecmd(buf + index)) == 0)
+      continue;
+    if((pid = spawncmd(cmd, 0)) < 0 && (pid = fork1()) == 0)
+      runcmd(cmd);
+    if(pid > 0)
+      wait();
+    freecmd(cmd);
   }
   exit();
 }
@@ -369,18 +420,34 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Set by syntax(): the shell parses commands itself, so a syntax
+// error mustn't exit, only make parsecmd() throw the line away.
+int syntax_error;
+
+void
+syntax(char *s)
+{
+  printf(2, "%s\n", s);
+  syntax_error = 1;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  syntax_error = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
   if(s != es){
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(syntax_error){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -424,8 +491,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -450,8 +519,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -476,13 +547,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc + 1 >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -536,3 +611,40 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
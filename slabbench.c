@@ -0,0 +1,56 @@
+// Parallel kernel allocation throughput: every process creates
+// and closes pipes as fast as it can, which takes two file
+// structures from the kmem_cache slab and a page from kalloc()
+// and gives them back.  Run with 1 to MAXPROCS processes; with
+// per-CPU caches the time should stay flat while there are CPUs
+// for all of them.
+
+#include "types.h"
+#include "user.h"
+
+#define MAXPROCS 8
+#define ITERS 20000
+
+void
+churn(void)
+{
+  int p[2];
+
+  for (int i = 0; i < ITERS; ++i) {
+    if (pipe(p) < 0) {
+      printf(2, "slabbench: pipe failed\n");
+      exit();
+    }
+    close(p[0]);
+    close(p[1]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf(1, "slabbench: %d pipe/close per process\n", ITERS);
+  printf(1, "procs\tticks\tallocs/tick\n");
+  for (int n = 1; n <= MAXPROCS; n *= 2) {
+    int start = uptime();
+    for (int i = 0; i < n; ++i) {
+      int pid = fork();
+      if (pid < 0) {
+        printf(2, "slabbench: fork failed\n");
+        exit();
+      }
+      if (pid == 0) {
+        churn();
+        exit();
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      wait();
+    }
+    int elapsed = uptime() - start;
+    // Two files and a pipe buffer per iteration.
+    printf(1, "%d\t%d\t%d\n", n, elapsed,
+        elapsed ? 3 * n * ITERS / elapsed : 0);
+  }
+  exit();
+}
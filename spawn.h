@@ -0,0 +1,23 @@
+/*
+ * File actions of posix_spawn(), done in order in the child
+ * before it runs the new program.
+ */
+#define SPAWN_OPEN  1 /* open path with oflag and mode as fd */
+#define SPAWN_CLOSE 2 /* close fd */
+#define SPAWN_DUP2  3 /* make newfd a copy of fd */
+
+#define SPAWN_MAXACTIONS 8
+
+struct spawn_action {
+  int op;
+  int fd;
+  int newfd;
+  int oflag;
+  int mode;
+  char *path;  /* not copied, must stay valid until posix_spawn() */
+};
+
+typedef struct posix_spawn_file_actions {
+  int n;
+  struct spawn_action actions[SPAWN_MAXACTIONS];
+} posix_spawn_file_actions_t;
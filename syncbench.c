@@ -0,0 +1,85 @@
+// Compare thread_mutex with a lock that spins calling sched_yield,
+// as our tools used to do, with more and more threads contending
+// for it.  Every thread increments a shared counter under the lock
+// and does a bit of work outside of it.
+
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "usync.h"
+
+#define MAXTHREADS 8
+#define ITERS 20000
+
+static struct thread_mutex mutex;
+static volatile uint spin;
+static volatile uint counter;
+static int use_mutex;
+
+static void
+work(void)
+{
+  for (volatile int i = 0; i < 50; ++i) {
+  }
+}
+
+void*
+worker(void* arg)
+{
+  for (int i = 0; i < ITERS; ++i) {
+    if (use_mutex) {
+      thread_mutex_lock(&mutex);
+      counter++;
+      thread_mutex_unlock(&mutex);
+    } else {
+      while (xchg(&spin, 1) != 0) {
+        sched_yield();
+      }
+      counter++;
+      xchg(&spin, 0);
+    }
+    work();
+  }
+  return 0;
+}
+
+// Returns the number of ticks it took, or -1.
+int
+run(int nthreads)
+{
+  thread_t threads[MAXTHREADS];
+
+  counter = 0;
+  int start = uptime();
+  for (int i = 0; i < nthreads; ++i) {
+    if (thread_create(&threads[i], worker, 0, 0) < 0) {
+      printf(2, "syncbench: thread_create failed\n");
+      exit();
+    }
+  }
+  for (int i = 0; i < nthreads; ++i) {
+    thread_join(threads[i], 0);
+  }
+  int elapsed = uptime() - start;
+  if (counter != nthreads * ITERS) {
+    printf(2, "syncbench: counter is %d instead of %d\n",
+        counter, nthreads * ITERS);
+    return -1;
+  }
+  return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf(1, "syncbench: %d lock/unlock per thread\n", ITERS);
+  printf(1, "threads\tmutex\tyield-spin (ticks)\n");
+  for (int n = 1; n <= MAXTHREADS; n *= 2) {
+    use_mutex = 1;
+    int mutex_ticks = run(n);
+    use_mutex = 0;
+    int spin_ticks = run(n);
+    printf(1, "%d\t%d\t%d\n", n, mutex_ticks, spin_ticks);
+  }
+  exit();
+}
@@ -20,6 +20,8 @@ fetchint(uint addr, int *ip)
 {
   if(addr >= proc->mm->sz || addr+4 > proc->mm->sz)
     return -1;
+  if(pagein_range(proc->mm, addr, 4) < 0)
+    return -1;
   *ip = *(int*)(addr);
   return 0;
 }
@@ -36,9 +38,15 @@ fetchstr(uint addr, char **pp)
     return -1;
   *pp = (char*)addr;
   ep = (char*)proc->mm->sz;
-  for(s = *pp; s < ep; s++)
+  for(s = *pp; s < ep; s++){
+    // Fault pages in here, where running out of memory is an
+    // error rather than a panic.
+    if((s == *pp || (uint)s % PGSIZE == 0) &&
+       pagein_range(proc->mm, (uint)s, 1) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
+  }
   return -1;
 }
 
@@ -61,6 +69,10 @@ argptr(int n, char **pp, int size)
     return -1;
   if((uint)i >= proc->mm->sz || (uint)i+size > proc->mm->sz)
     return -1;
+  // The block may be used with a spinlock held, where a page fault
+  // can't go and read it from disk.
+  if(size > 0 && pagein_range(proc->mm, i, size) < 0)
+    return -1;
   *pp = (char*)i;
   return 0;
 }
@@ -117,6 +129,16 @@ extern int sys_sched_yield(void);
 extern int sys_mount(void);
 extern int sys_chroot(void);
 extern int sys_mmap(void);
+extern int sys_nice(void);
+extern int sys_getpriority(void);
+extern int sys_setpriority(void);
+extern int sys_sched_setattr(void);
+extern int sys_sched_getattr(void);
+extern int sys_sched_setaffinity(void);
+extern int sys_sched_getaffinity(void);
+extern int sys_read_timeout(void);
+extern int sys_futex(void);
+extern int sys_spawn(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -158,6 +180,16 @@ static int (*syscalls[])(void) = {
 [SYS_mount] sys_mount,
 [SYS_chroot] sys_chroot,
 [SYS_mmap] sys_mmap,
+[SYS__nice] sys_nice,
+[SYS__getpriority] sys_getpriority,
+[SYS_setpriority] sys_setpriority,
+[SYS_sched_setattr] sys_sched_setattr,
+[SYS_sched_getattr] sys_sched_getattr,
+[SYS_sched_setaffinity] sys_sched_setaffinity,
+[SYS_sched_getaffinity] sys_sched_getaffinity,
+[SYS_read_timeout] sys_read_timeout,
+[SYS_futex] sys_futex,
+[SYS_spawn] sys_spawn,
 };
 
 void
@@ -38,3 +38,13 @@
 #define SYS_mount       37
 #define SYS_chroot      38
 #define SYS_mmap        39
+#define SYS__nice       40
+#define SYS__getpriority 41
+#define SYS_setpriority 42
+#define SYS_sched_setattr 43
+#define SYS_sched_getattr 44
+#define SYS_sched_setaffinity 45
+#define SYS_sched_getaffinity 46
+#define SYS_read_timeout 47
+#define SYS_futex       48
+#define SYS_spawn       49
@@ -17,6 +17,7 @@
 #include "errno.h"
 #include "stat.h"
 #include "err.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -83,7 +84,22 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
     return -EINVAL;
-  return fileread(f, p, n);
+  return fileread(f, p, n, 0);
+}
+
+// Like read, but fail with ETIMEDOUT if a pipe has no data
+// for timeout ticks.
+int
+sys_read_timeout(void)
+{
+  struct file *f;
+  int n, timeout;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+     argint(3, &timeout) < 0 || timeout < 0)
+    return -EINVAL;
+  return fileread(f, p, n, timeout);
 }
 
 int
@@ -100,21 +116,59 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
-int
-sys_close(void)
+// Close file descriptor fd of the current process.
+static int
+fdclose(int fd)
 {
-  int fd;
   struct file *f;
-  
-  if(argfd(0, &fd, &f) < 0)
-    return -EBADF;
+
   acquire(&proc->files->lock);
+  if(fd < 0 || fd >= NOFILE || (f=proc->files->fd[fd]) == 0){
+    release(&proc->files->lock);
+    return -EBADF;
+  }
   proc->files->fd[fd] = 0;
   release(&proc->files->lock);
   fileclose(f);
   return 0;
 }
 
+// Make newfd refer to the same file as oldfd, closing whatever
+// it referred to before, like dup2().
+static int
+fddup2(int oldfd, int newfd)
+{
+  struct file *f, *old;
+
+  if(newfd < 0 || newfd >= NOFILE)
+    return -EBADF;
+  acquire(&proc->files->lock);
+  if(oldfd < 0 || oldfd >= NOFILE || (f=proc->files->fd[oldfd]) == 0){
+    release(&proc->files->lock);
+    return -EBADF;
+  }
+  if(oldfd == newfd){
+    release(&proc->files->lock);
+    return 0;
+  }
+  old = proc->files->fd[newfd];
+  proc->files->fd[newfd] = filedup(f);
+  release(&proc->files->lock);
+  if(old)
+    fileclose(old);
+  return 0;
+}
+
+int
+sys_close(void)
+{
+  int fd;
+
+  if(argint(0, &fd) < 0)
+    return -EBADF;
+  return fdclose(fd);
+}
+
 int
 sys_fstat(void)
 {
@@ -362,20 +416,17 @@ sys_mount(void)
   return mount_proc_fs(ip, parent);
 }
 
-int
-sys_open(void)
+// Open path in the current process and return the new file
+// descriptor.  mode is only used if the file gets created.
+static int
+fileopen(char *path, int omode, int mode)
 {
-  char *path;
-  int fd, omode, mode;
+  int fd;
   struct file *f;
   struct inode *ip;
 
-  if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
-    return -EINVAL;
   ip = 0;
   if((omode & O_CREATE) && IS_ERR(ip = namei(path))){
-    if(argint(2, &mode) < 0)
-      return -EINVAL;
     begin_trans();
     ip = create(path, T_FILE, 0, 0, mode);
     commit_trans();
@@ -515,6 +566,20 @@ sys_open(void)
   return fd;
 }
 
+int
+sys_open(void)
+{
+  char *path;
+  int omode, mode;
+
+  if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
+    return -EINVAL;
+  mode = 0;
+  if((omode & O_CREATE) && argint(2, &mode) < 0)
+    return -EINVAL;
+  return fileopen(path, omode, mode);
+}
+
 int
 sys_mkdir(void)
 {
@@ -630,44 +695,130 @@ sys_chroot(void)
   return 0;
 }
 
+// Fetch the null-terminated array of at most MAXARG strings at
+// user address uv into v.
+static int
+fetchargs(uint uv, char **v)
+{
+  int i;
+  uint uarg;
+
+  for(i=0;; i++){
+    if(i >= MAXARG)
+      return -E2BIG;
+    if(fetchint(uv+4*i, (int*)&uarg) < 0)
+      return -EINVAL;
+    if(uarg == 0){
+      v[i] = 0;
+      return 0;
+    }
+    if(fetchstr(uarg, &v[i]) < 0)
+      return -EINVAL;
+  }
+}
+
 int
 sys_execve(void)
 {
   char *path, *argv[MAXARG], *envp[MAXARG];
-  int i;
-  uint uargv, uarg, uenvp;
+  int st;
+  uint uargv, uenvp;
 
   if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 ||
       argint(2, (int*)&uenvp) < 0){
     return -EINVAL;
   }
-  memset(argv, 0, sizeof(argv));
-  for(i=0;; i++){
-    if(i >= NELEM(argv))
-      return -E2BIG;
-    if(fetchint(uargv+4*i, (int*)&uarg) < 0)
-      return -EINVAL;
-    if(uarg == 0){
-      argv[i] = 0;
+  if((st = fetchargs(uargv, argv)) < 0 || (st = fetchargs(uenvp, envp)) < 0)
+    return st;
+  return exec(path, argv, envp);
+}
+
+// What the child of sys_spawn() gets from its parent, who keeps it
+// on its kernel stack until the child has exec'd or exited.  The
+// strings are in the parent's memory, which the child shares until
+// then.
+struct spawnargs {
+  char *path;
+  char *argv[MAXARG];
+  char *envp[MAXARG];
+  posix_spawn_file_actions_t fa;
+  int error;
+};
+
+// Run by the child of sys_spawn(), see spawn().
+static int
+spawnchild(void *arg)
+{
+  struct spawnargs *sa = arg;
+  struct spawn_action *a;
+  int fd, st;
+
+  st = 0;
+  for(a = sa->fa.actions; st == 0 && a < sa->fa.actions + sa->fa.n; a++){
+    switch(a->op){
+    case SPAWN_OPEN:
+      if((fd = fileopen(a->path, a->oflag, a->mode)) < 0)
+        st = fd;
+      else if(fd != a->fd && (st = fddup2(fd, a->fd)) == 0)
+        st = fdclose(fd);
+      break;
+    case SPAWN_CLOSE:
+      st = fdclose(a->fd);
+      break;
+    case SPAWN_DUP2:
+      st = fddup2(a->fd, a->newfd);
       break;
     }
-    if(fetchstr(uarg, &argv[i]) < 0)
-      return -EINVAL;
   }
-  uint temp;
-  for(i=0;; i++){
-    if(i >= NELEM(envp))
-      return -E2BIG;
-    if(fetchint(uenvp+4*i, (int*)&temp) < 0)
+  if(st == 0)
+    st = exec(sa->path, sa->argv, sa->envp);
+  // A successful exec has let the parent go, and sa with it: the
+  // parent may already have returned from sys_spawn().  Only a
+  // failure, which keeps it waiting, may be reported.
+  if(st < 0)
+    sa->error = st;
+  return st;
+}
+
+// Start a program in a new process, like fork() and execve() but
+// without copying our memory: the child borrows it while it does
+// the file actions and loads the program.  Returns the pid of the
+// child, or the error that kept it from starting the program.
+int
+sys_spawn(void)
+{
+  struct spawnargs sa;
+  struct spawn_action *a;
+  char *ufa;
+  uint uargv, uenvp;
+  int st, pid;
+
+  if(argstr(0, &sa.path) < 0 || argint(2, (int*)&uargv) < 0 ||
+      argint(3, (int*)&uenvp) < 0)
+    return -EINVAL;
+  if((st = fetchargs(uargv, sa.argv)) < 0 ||
+     (st = fetchargs(uenvp, sa.envp)) < 0)
+    return st;
+  sa.fa.n = 0;
+  if(argint(1, (int*)&ufa) < 0)
+    return -EINVAL;
+  if(ufa){
+    if(argptr(1, &ufa, sizeof(sa.fa)) < 0)
       return -EINVAL;
-    if(temp == 0){
-      envp[i] = 0;
-      break;
-    }
-    if(fetchstr(temp, &envp[i]) < 0)
+    memmove(&sa.fa, ufa, sizeof(sa.fa));
+    if(sa.fa.n < 0 || sa.fa.n > SPAWN_MAXACTIONS)
       return -EINVAL;
+    for(a = sa.fa.actions; a < sa.fa.actions + sa.fa.n; a++){
+      if(a->op == SPAWN_OPEN && fetchstr((uint)a->path, &a->path) < 0)
+        return -EINVAL;
+      if(a->op < SPAWN_OPEN || a->op > SPAWN_DUP2)
+        return -EINVAL;
+    }
   }
-  return exec(path, argv, envp);
+  sa.error = 0;
+  if((pid = spawn(spawnchild, &sa)) < 0)
+    return pid;
+  return sa.error < 0 ? sa.error : pid;
 }
 
 int
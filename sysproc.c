@@ -6,22 +6,27 @@
 #include "mmu.h"
 #include "proc.h"
 #include "errno.h"
+#include "resource.h"
+#include "sched.h"
+#include "futex.h"
 
 int
 sys_fork(void)
 {
-  return clone(0, 0);
+  return clone(0, 0, 0, 0);
 }
 
 int
 sys_clone(void)
 {
   char* stack;
-  int flags;
+  int flags, tls, ctid;
   if (argptr(0, &stack, 0) < 0 ||
-      argint(1, &flags) < 0)
+      argint(1, &flags) < 0 ||
+      argint(2, &tls) < 0 ||
+      argint(3, &ctid) < 0)
     return -EINVAL;
-  return clone(stack, flags);
+  return clone(stack, flags, tls, ctid);
 }
 
 int
@@ -89,7 +94,8 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // Nothing else wakes &ticks0 up, only the timeout or kill().
+    sleep_timeout(&ticks0, &tickslock, n - (ticks - ticks0));
   }
   release(&tickslock);
   return 0;
@@ -98,10 +104,110 @@ sys_sleep(void)
 int
 sys_sched_yield(void)
 {
+  // A deadline process is done with its job until the next period.
+  if(proc->policy == SCHED_DEADLINE)
+    proc->dl_left = 0;
   yield();
   return 0;
 }
 
+// Nice values can be negative, which would look like an error,
+// so _nice and _getpriority return 20 - nice instead, as on Linux.
+// The wrappers in ulib.c convert it back.
+int
+sys_nice(void)
+{
+  int inc, err;
+
+  if(argint(0, &inc) < 0)
+    return -EINVAL;
+  if((err = setpriority(PRIO_PROCESS, 0, proc->nice + inc)) < 0)
+    return err == -EACCES ? -EPERM : err;
+  return 20 - proc->nice;
+}
+
+int
+sys_getpriority(void)
+{
+  int which, who, nice, err;
+
+  if(argint(0, &which) < 0 || argint(1, &who) < 0)
+    return -EINVAL;
+  if((err = getpriority(which, who, &nice)) < 0)
+    return err;
+  return 20 - nice;
+}
+
+int
+sys_sched_setattr(void)
+{
+  int pid;
+  struct sched_attr *attr;
+
+  if(argint(0, &pid) < 0 || argptr(1, (char**)&attr, sizeof(*attr)) < 0)
+    return -EINVAL;
+  return sched_setattr(pid, attr);
+}
+
+int
+sys_sched_getattr(void)
+{
+  int pid;
+  struct sched_attr *attr;
+
+  if(argint(0, &pid) < 0 || argptr(1, (char**)&attr, sizeof(*attr)) < 0)
+    return -EINVAL;
+  return sched_getattr(pid, attr);
+}
+
+int
+sys_sched_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -EINVAL;
+  return sched_setaffinity(pid, mask);
+}
+
+int
+sys_sched_getaffinity(void)
+{
+  int pid;
+  uint *mask;
+
+  if(argint(0, &pid) < 0 || argptr(1, (char**)&mask, sizeof(*mask)) < 0)
+    return -EINVAL;
+  return sched_getaffinity(pid, mask);
+}
+
+int
+sys_futex(void)
+{
+  int addr, op, val, timeout;
+
+  if(argint(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0 ||
+     argint(3, &timeout) < 0)
+    return -EINVAL;
+  switch(op){
+  case FUTEX_WAIT:
+    return futex_wait(addr, val, timeout);
+  case FUTEX_WAKE:
+    return futex_wake(addr, val);
+  }
+  return -EINVAL;
+}
+
+int
+sys_setpriority(void)
+{
+  int which, who, nice;
+
+  if(argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &nice) < 0)
+    return -EINVAL;
+  return setpriority(which, who, nice);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 int
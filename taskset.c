@@ -0,0 +1,66 @@
+#include "types.h"
+#include "user.h"
+#include "errno.h"
+
+// taskset mask prog [args]
+// taskset -p mask pid
+// Run prog, or change process pid, to run only on the CPUs
+// whose bits are set in the hexadecimal mask.
+int
+parse_mask(char* s, uint* mask)
+{
+  *mask = 0;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+  if (*s == 0)
+    return -1;
+  for (; *s; ++s) {
+    int digit;
+    if ('0' <= *s && *s <= '9')
+      digit = *s - '0';
+    else if ('a' <= *s && *s <= 'f')
+      digit = *s - 'a' + 10;
+    else if ('A' <= *s && *s <= 'F')
+      digit = *s - 'A' + 10;
+    else
+      return -1;
+    *mask = *mask * 16 + digit;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  uint mask;
+  int pid = 0;
+  int i = 1;
+  if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+    if (argc != 4) {
+      printf(2, "Usage: taskset -p mask pid\n");
+      return 1;
+    }
+    pid = atoi(argv[3]);
+    i = 2;
+  } else if (argc < 3) {
+    printf(2, "Usage: taskset mask prog [args]\n");
+    return 1;
+  }
+  if (parse_mask(argv[i], &mask) < 0) {
+    printf(2, "Bad mask %s\n", argv[i]);
+    return 1;
+  }
+  if (sched_setaffinity(pid, mask) < 0) {
+    if (errno == EPERM) {
+      printf(2, "Permission denied\n");
+      return 1;
+    }
+    printf(2, "sched_setaffinity error. Errno: %d\n", errno);
+    return 1;
+  }
+  if (pid != 0) {
+    return 0;
+  }
+  execvpe(argv[2], argv + 2, environ);
+  printf(2, "Failed to execute %s. Errno = %d\n", argv[2], errno);
+  return 1;
+}
@@ -0,0 +1,144 @@
+// Text page cache.
+//
+// Pages of programs, which exec leaves to be read in on first
+// touch, are kept here by inode and file offset, so that every
+// process running the same program maps the same physical pages
+// instead of reading in copies of its own.  pagein() maps them
+// read-only, and copy-on-write if the segment is writable.
+//
+// The cache holds a reference to each of its pages (see kref())
+// and lets go of the least recently used one when it is full.
+// Writing to or truncating a file drops its pages, so processes
+// started afterwards see the new contents; processes already
+// running keep the pages they have.
+//
+// Callers hold the inode locked, which keeps two of them from
+// reading in the same page at once.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "list.h"
+#include "fs.h"
+#include "file.h"
+
+#define NTEXTHASH 64
+
+struct textpage {
+  struct filesystem *fs;  // 0 if the entry is free
+  uint inum;
+  uint off;               // Offset in the file of the page's first byte
+  char *page;
+  struct list_head hash;  // In the bucket of its inode
+  struct list_head lru;   // Most recently used first, free ones last
+};
+
+struct {
+  struct spinlock lock;
+  struct textpage entries[NTEXTPAGE];
+  struct list_head hash[NTEXTHASH];
+  struct list_head lru;
+} textcache;
+
+void
+textinit(void)
+{
+  struct textpage *t;
+  int i;
+
+  initlock(&textcache.lock, "textcache");
+  for(i = 0; i < NTEXTHASH; i++)
+    INIT_LIST_HEAD(&textcache.hash[i]);
+  INIT_LIST_HEAD(&textcache.lru);
+  for(t = textcache.entries; t < textcache.entries+NTEXTPAGE; t++){
+    t->fs = 0;
+    INIT_LIST_HEAD(&t->hash);
+    list_add_tail(&t->lru, &textcache.lru);
+  }
+}
+
+// All the pages of an inode are in the same bucket, so that
+// textinval() has only one to look at.
+static struct list_head*
+bucket(struct inode *ip)
+{
+  return &textcache.hash[(ip->inum ^ (uint)ip->fs) % NTEXTHASH];
+}
+
+static void
+drop(struct textpage *t)
+{
+  list_del_init(&t->hash);
+  kfree(t->page);
+  t->fs = 0;
+  list_del(&t->lru);
+  list_add_tail(&t->lru, &textcache.lru);
+}
+
+// Return the page holding the PGSIZE bytes of locked inode ip
+// from off on, zero past its end, with a reference for the
+// caller to give back with kfree().  Returns 0 if out of memory
+// or if off is past the end of the file.
+char*
+textpage(struct inode *ip, uint off)
+{
+  struct list_head *b = bucket(ip);
+  struct textpage *t;
+  char *mem;
+  int n;
+
+  acquire(&textcache.lock);
+  list_for_each_entry(t, b, hash){
+    if(t->fs == ip->fs && t->inum == ip->inum && t->off == off){
+      list_del(&t->lru);
+      list_add(&t->lru, &textcache.lru);
+      kref(t->page);
+      release(&textcache.lock);
+      return t->page;
+    }
+  }
+  release(&textcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  if((n = readi(ip, mem, off, PGSIZE)) < 0){
+    kfree(mem);
+    return 0;
+  }
+  memset(mem + n, 0, PGSIZE - n);
+
+  acquire(&textcache.lock);
+  t = list_entry(textcache.lru.prev, struct textpage, lru);
+  if(t->fs)
+    drop(t);
+  t->fs = ip->fs;
+  t->inum = ip->inum;
+  t->off = off;
+  t->page = mem;
+  list_add(&t->hash, b);
+  list_del(&t->lru);
+  list_add(&t->lru, &textcache.lru);
+  kref(mem);
+  release(&textcache.lock);
+  return mem;
+}
+
+// Forget the cached pages of locked inode ip, which is about to
+// change.
+void
+textinval(struct inode *ip)
+{
+  struct list_head *b = bucket(ip);
+  struct list_head *pos, *next;
+  struct textpage *t;
+
+  acquire(&textcache.lock);
+  list_for_each_safe(pos, next, b){
+    t = list_entry(pos, struct textpage, hash);
+    if(t->fs == ip->fs && t->inum == ip->inum)
+      drop(t);
+  }
+  release(&textcache.lock);
+}
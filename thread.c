@@ -3,6 +3,9 @@
 #include "syscall.h"
 #include "clone_flags.h"
 #include "errno.h"
+#include "futex.h"
+#include "tls.h"
+#include "usync.h"
 
 struct thread
 {
@@ -10,46 +13,117 @@ struct thread
   void* arg;
   void* stack;
 
-  int exited;
+  // Cleared by the kernel once the thread is gone
+  // (CLONE_CHILD_CLEARTID), its stack can be freed then.
+  volatile int running;
   void* result;
   int detached;
+  struct thread* next_detached;
 };
 
+// Detached threads, whose stacks are freed by later thread_create()
+// calls.  A thread can't free its own stack, since it keeps using it
+// until it is out of _exit().
+static struct thread* detached_threads;
+static struct thread_mutex detached_lock;
+
 int
 start_thread(void* arg)
 {
   struct thread* thread = (struct thread*)arg;
   thread->result = thread->user_function(thread->arg);
-  thread->exited = 1;
-  if (thread->detached) {
+  malloc_thread_exit();
+  _exit();
+}
+
+static void
+add_detached(struct thread* thread)
+{
+  thread_mutex_lock(&detached_lock);
+  thread->next_detached = detached_threads;
+  detached_threads = thread;
+  thread_mutex_unlock(&detached_lock);
+}
+
+static void
+reap_detached(void)
+{
+  struct thread** pp;
+  struct thread* thread;
+
+  thread_mutex_lock(&detached_lock);
+  for (pp = &detached_threads; (thread = *pp) != 0; ) {
+    if (thread->running) {
+      pp = &thread->next_detached;
+      continue;
+    }
+    *pp = thread->next_detached;
     free(thread->stack);
   }
-  _exit();
+  thread_mutex_unlock(&detached_lock);
 }
 
 #ifndef PGSIZE
 #define PGSIZE 4096
 #endif
 
+static struct tls_tcb*
+tls_self(void)
+{
+  struct tls_tcb* tcb;
+  asm("movl %%gs:0, %0" : "=r" (tcb));
+  return tcb;
+}
+
+// Build the thread-local storage of a new thread at the start of
+// mem, with the initial values the program was loaded with.
+// Returns its thread control block.
+static struct tls_tcb*
+tls_init(void* mem)
+{
+  struct tls_tcb* self = tls_self();
+  uint tp = ((uint)mem + self->size + self->align - 1) & ~(self->align - 1);
+  char* block = (char*)tp - self->size;
+
+  memmove(block, (void*)self->image, self->filesz);
+  memset(block + self->filesz, 0, self->size - self->filesz);
+  struct tls_tcb* tcb = (struct tls_tcb*)tp;
+  *tcb = *self;
+  tcb->self = tcb;
+  return tcb;
+}
+
 int
 thread_create(thread_t* thread, void* (*fn)(void*), void* arg, int detached)
 {
-  void* stack = malloc(2 * PGSIZE);
+  reap_detached();
+  // The thread's TLS goes below its stack, in the same allocation.
+  uint tls_size = tls_self()->size + tls_self()->align +
+    sizeof(struct tls_tcb);
+  void* stack = malloc(tls_size + 2 * PGSIZE);
   if (!stack) {
     errno = ENOMEM;
     return -1;
   }
   void* original_stack = stack;
-  stack += 2 * PGSIZE;
+  struct tls_tcb* tcb = tls_init(stack);
+  stack += tls_size + 2 * PGSIZE;
   struct thread* result = (struct thread*)stack;
   *--result = (struct thread) {
     .user_function = fn,
     .arg = arg,
     .stack = original_stack,
-    .exited = 0,
+    .running = 1,
     .detached = detached,
   };
-  clone_fn(start_thread, (void*)result, (void*)result);
+  if (clone_fn(start_thread, (void*)result, (void*)result, tcb,
+        &result->running) < 0) {
+    free(original_stack);
+    return -1;
+  }
+  if (detached) {
+    add_detached(result);
+  }
   *thread = (thread_t)result;
   return 0;
 }
@@ -62,8 +136,8 @@ thread_join(thread_t thread_id, void** retval)
     errno = EINVAL;
     return -1;
   }
-  while (!thread->exited) {
-    sched_yield();
+  while (thread->running) {
+    futex(&thread->running, FUTEX_WAIT, 1, 0);
   }
 
   if (retval != 0) {
@@ -79,6 +153,11 @@ int
 thread_detach(thread_t thread_id)
 {
   struct thread* thread = (struct thread*)thread_id;
+  if (thread->detached) {
+    errno = EINVAL;
+    return -1;
+  }
   thread->detached = 1;
+  add_detached(thread);
   return 0;
 }
@@ -0,0 +1,277 @@
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "futex.h"
+#include "usync.h"
+#include "threadpool.h"
+
+#define MAXWORKERS 16
+#define DEQUE_SIZE 256
+
+struct task {
+  void (*fn)(void*);
+  void* arg;
+  struct pool_group* group;
+};
+
+// The owner works at the bottom, thieves take from the top.
+// Indices only grow, slots are index % DEQUE_SIZE.
+struct worker {
+  struct thread_mutex lock;
+  volatile uint top;
+  volatile uint bottom;
+  struct task tasks[DEQUE_SIZE];
+  thread_t thread;
+  uint seed;               // For picking victims
+};
+
+static struct worker workers[MAXWORKERS];
+static int nworkers;       // Including the thread that started the pool
+static volatile uint stopping;
+static volatile uint work_seq;  // Bumped whenever a task is pushed
+static volatile uint sleepers;  // Workers waiting for work_seq to move
+
+// Index of the calling thread's worker.  The thread that starts
+// the pool is worker 0, and so is any thread outside of the pool.
+static __thread int self;
+
+// Number of CPUs, from /proc/cpustat.
+int
+pool_ncpu(void)
+{
+  char buf[128];
+  int fd, n, lines = 0, bol = 1;
+
+  if ((fd = open("/proc/cpustat", 0)) < 0) {
+    return 1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (int i = 0; i < n; ++i) {
+      if (bol && buf[i] == 'c') {
+        lines++;
+      }
+      bol = buf[i] == '\n';
+    }
+  }
+  close(fd);
+  return lines > 0 ? lines : 1;
+}
+
+static int
+push(struct worker* w, struct task* t)
+{
+  int ok = 0;
+
+  thread_mutex_lock(&w->lock);
+  if (w->bottom - w->top < DEQUE_SIZE) {
+    w->tasks[w->bottom % DEQUE_SIZE] = *t;
+    w->bottom++;
+    ok = 1;
+  }
+  thread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+static int
+pop(struct worker* w, struct task* t)
+{
+  int ok = 0;
+
+  thread_mutex_lock(&w->lock);
+  if (w->bottom != w->top) {
+    w->bottom--;
+    *t = w->tasks[w->bottom % DEQUE_SIZE];
+    ok = 1;
+  }
+  thread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+// Thieves don't wait for a busy deque, they try another one.
+static int
+steal(struct worker* w, struct task* t)
+{
+  int ok = 0;
+
+  if (w->bottom == w->top || thread_mutex_trylock(&w->lock) < 0) {
+    return 0;
+  }
+  if (w->bottom != w->top) {
+    *t = w->tasks[w->top % DEQUE_SIZE];
+    w->top++;
+    ok = 1;
+  }
+  thread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+// Own tasks first, newest first; then the oldest task of a random
+// victim, then of anybody.
+static int
+find_task(struct task* t)
+{
+  struct worker* me = &workers[self];
+
+  if (pop(me, t)) {
+    return 1;
+  }
+  for (int i = 0; i < nworkers; ++i) {
+    me->seed = me->seed * 1103515245 + 12345;
+    int victim = (me->seed >> 16) % nworkers;
+    if (victim != self && steal(&workers[victim], t)) {
+      return 1;
+    }
+  }
+  for (int i = 0; i < nworkers; ++i) {
+    if (i != self && steal(&workers[i], t)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+run(struct task* t)
+{
+  struct pool_group* group = t->group;
+
+  t->fn(t->arg);
+  if (fetch_add(&group->pending, -1) == 1) {
+    futex((volatile int*)&group->pending, FUTEX_WAKE, MAXWORKERS, 0);
+  }
+}
+
+void
+pool_spawn(struct pool_group* group, void (*fn)(void*), void* arg)
+{
+  struct task t = { fn, arg, group };
+
+  atomic_add(&group->pending, 1);
+  if (nworkers <= 1 || !push(&workers[self], &t)) {
+    run(&t);
+    return;
+  }
+  // Registering as a sleeper before reading work_seq pairs with
+  // bumping it here before looking at sleepers.
+  atomic_add(&work_seq, 1);
+  if (sleepers) {
+    futex((volatile int*)&work_seq, FUTEX_WAKE, 1, 0);
+  }
+}
+
+// Sleep on pending for a tick at most: tasks that show up after
+// we looked for some are run by the workers they wake up, the
+// timeout only covers for them all being stuck in pool_sync().
+void
+pool_sync(struct pool_group* group)
+{
+  struct task t;
+  uint pending;
+
+  while ((pending = group->pending) != 0) {
+    if (find_task(&t)) {
+      run(&t);
+    } else {
+      futex((volatile int*)&group->pending, FUTEX_WAIT, pending, 1);
+    }
+  }
+}
+
+static void*
+worker_main(void* arg)
+{
+  struct task t;
+
+  self = (int)arg;
+  while (!stopping) {
+    if (find_task(&t)) {
+      run(&t);
+      continue;
+    }
+    atomic_add(&sleepers, 1);
+    uint seq = work_seq;
+    if (find_task(&t)) {
+      atomic_add(&sleepers, -1);
+      run(&t);
+      continue;
+    }
+    if (!stopping) {
+      futex((volatile int*)&work_seq, FUTEX_WAIT, seq, 0);
+    }
+    atomic_add(&sleepers, -1);
+  }
+  return 0;
+}
+
+// Start a pool of n threads, counting the caller, or one per CPU
+// if n is 0.  Returns the number of threads.
+int
+pool_start(int n)
+{
+  if (n <= 0) {
+    n = pool_ncpu();
+  }
+  if (n > MAXWORKERS) {
+    n = MAXWORKERS;
+  }
+  stopping = 0;
+  self = 0;
+  workers[0].seed = 1;
+  nworkers = 1;
+  // Workers look at nworkers, so they only ever see started ones.
+  for (int i = 1; i < n; ++i) {
+    workers[i].seed = i + 1;
+    if (thread_create(&workers[i].thread, worker_main, (void*)i, 0) < 0) {
+      break;
+    }
+    nworkers++;
+  }
+  return nworkers;
+}
+
+void
+pool_stop(void)
+{
+  stopping = 1;
+  atomic_add(&work_seq, 1);
+  futex((volatile int*)&work_seq, FUTEX_WAKE, MAXWORKERS, 0);
+  for (int i = 1; i < nworkers; ++i) {
+    thread_join(workers[i].thread, 0);
+  }
+  nworkers = 0;
+}
+
+struct range {
+  int lo, hi, grain;
+  void (*body)(int, int, void*);
+  void* arg;
+};
+
+static void
+range_task(void* arg)
+{
+  struct range* r = arg;
+  parallel_for(r->lo, r->hi, r->grain, r->body, r->arg);
+}
+
+// Call body on pieces of [lo, hi) of at most grain elements,
+// in parallel, and return once all are done.
+void
+parallel_for(int lo, int hi, int grain, void (*body)(int, int, void*),
+    void* arg)
+{
+  struct pool_group group = { 0 };
+
+  if (grain < 1) {
+    grain = 1;
+  }
+  if (hi - lo <= grain) {
+    body(lo, hi, arg);
+    return;
+  }
+  int mid = lo + (hi - lo) / 2;
+  struct range right = { mid, hi, grain, body, arg };
+  pool_spawn(&group, range_task, &right);
+  parallel_for(lo, mid, grain, body, arg);
+  pool_sync(&group);
+}
@@ -0,0 +1,21 @@
+// A pool of worker threads running short tasks.
+//
+// Each worker has a deque of tasks: it pushes and pops its own at
+// one end, idle workers steal from the other end of a random
+// victim's.  Workers and their stacks live as long as the pool, so
+// a task costs a few atomic operations rather than a clone().
+//
+// Tasks are grouped: pool_sync() waits until every task spawned in
+// a group is done, running tasks itself while it waits.  Without a
+// running pool, pool_spawn() simply calls the task.
+
+struct pool_group {
+  volatile uint pending;  // Spawned and not yet finished
+};
+
+int pool_ncpu(void);
+int pool_start(int);
+void pool_stop(void);
+void pool_spawn(struct pool_group*, void (*)(void*), void*);
+void pool_sync(struct pool_group*);
+void parallel_for(int, int, int, void (*)(int, int, void*), void*);
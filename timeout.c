@@ -0,0 +1,156 @@
+// Timeouts.
+//
+// Pending timeouts are kept in a hierarchical timing wheel, as in
+// the Linux kernel: level 0 has a slot for each of the next 256
+// ticks, and each of the three levels above has 64 slots, each
+// covering 64 times as many ticks as a slot of the level below.
+// Adding and deleting a timeout are O(1).  Every tick runs the
+// timeouts of one slot of level 0; every 256 ticks a slot of a
+// higher level is cascaded down into the levels below.
+//
+// Timeouts run from the timer interrupt of CPU 0, without
+// wheel.lock held, so they may wake processes up.
+// They must not call timeout_del() on themselves.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "timeout.h"
+
+#define TW0_BITS  8
+#define TWN_BITS  6
+#define TW0_SIZE  (1 << TW0_BITS)
+#define TWN_SIZE  (1 << TWN_BITS)
+#define TWN_LEVELS 3
+// Timeouts further away than this run after TW_MAX ticks.
+#define TW_MAX    ((1u << (TW0_BITS + TWN_LEVELS * TWN_BITS)) - 1)
+
+// Slot of level n + 1 that tick t falls in.
+#define TWN_INDEX(t, n) (((t) >> (TW0_BITS + (n) * TWN_BITS)) & (TWN_SIZE - 1))
+
+static struct {
+  struct spinlock lock;
+  uint now;                    // Next tick to run the timeouts of
+  struct list_head tw0[TW0_SIZE];
+  struct list_head twn[TWN_LEVELS][TWN_SIZE];
+  struct timeout* volatile running; // Timeout whose fn is being called
+} wheel;
+
+void
+timeoutinit(void)
+{
+  initlock(&wheel.lock, "timeout");
+  for (int i = 0; i < TW0_SIZE; ++i) {
+    INIT_LIST_HEAD(&wheel.tw0[i]);
+  }
+  for (int n = 0; n < TWN_LEVELS; ++n) {
+    for (int i = 0; i < TWN_SIZE; ++i) {
+      INIT_LIST_HEAD(&wheel.twn[n][i]);
+    }
+  }
+  wheel.now = ticks;
+}
+
+void
+timeout_init(struct timeout* t, void (*fn)(void*), void* arg)
+{
+  INIT_LIST_HEAD(&t->list);
+  t->fn = fn;
+  t->arg = arg;
+}
+
+// Put t in the slot for t->expires.  wheel.lock must be held.
+static void
+wheel_add(struct timeout* t)
+{
+  uint delta = t->expires - wheel.now;
+  struct list_head* slot;
+
+  if ((int)delta < 0) {
+    // Already due, run it on the next tick.
+    slot = &wheel.tw0[wheel.now & (TW0_SIZE - 1)];
+  } else if (delta < TW0_SIZE) {
+    slot = &wheel.tw0[t->expires & (TW0_SIZE - 1)];
+  } else {
+    if (delta > TW_MAX) {
+      t->expires = wheel.now + TW_MAX;
+      delta = TW_MAX;
+    }
+    int n = 0;
+    while (delta >= (1u << (TW0_BITS + (n + 1) * TWN_BITS))) {
+      n++;
+    }
+    slot = &wheel.twn[n][TWN_INDEX(t->expires, n)];
+  }
+  list_add_tail(&t->list, slot);
+}
+
+// Call t->fn(t->arg) when ticks reaches expires.
+// t must not be pending already.
+void
+timeout_add(struct timeout* t, uint expires)
+{
+  acquire(&wheel.lock);
+  t->expires = expires;
+  wheel_add(t);
+  release(&wheel.lock);
+}
+
+// Cancel t.  Returns 1 if it was pending, 0 if it has run already.
+// In that case waits for its fn to return, so t can be freed after.
+int
+timeout_del(struct timeout* t)
+{
+  int pending;
+
+  acquire(&wheel.lock);
+  pending = !list_empty(&t->list);
+  list_del_init(&t->list);
+  release(&wheel.lock);
+  while (wheel.running == t)
+    ;
+  return pending;
+}
+
+// Move the timeouts of a slot of level n + 1 down to where they
+// belong now.  Returns the index of the slot.
+// wheel.lock must be held.
+static int
+cascade(int n, int index)
+{
+  struct list_head *pos, *next;
+  list_for_each_safe(pos, next, &wheel.twn[n][index]) {
+    list_del(pos);
+    wheel_add(list_entry(pos, struct timeout, list));
+  }
+  return index;
+}
+
+// Run the timeouts that are due.  Called by CPU 0 on every tick.
+void
+timeout_run(void)
+{
+  acquire(&wheel.lock);
+  while ((int)(ticks - wheel.now) >= 0) {
+    int index = wheel.now & (TW0_SIZE - 1);
+    if (index == 0) {
+      for (int n = 0; n < TWN_LEVELS; ++n) {
+        if (cascade(n, TWN_INDEX(wheel.now, n)) != 0)
+          break;
+      }
+    }
+    wheel.now++;
+    struct list_head* slot = &wheel.tw0[index];
+    while (!list_empty(slot)) {
+      struct timeout* t = list_entry(slot->next, struct timeout, list);
+      list_del_init(&t->list);
+      wheel.running = t;
+      release(&wheel.lock);
+      t->fn(t->arg);
+      acquire(&wheel.lock);
+      wheel.running = 0;
+    }
+  }
+  release(&wheel.lock);
+}
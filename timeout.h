@@ -0,0 +1,14 @@
+#ifndef XV6_TIMEOUT_H_
+#define XV6_TIMEOUT_H_
+
+#include "list.h"
+
+// A function to call at a given tick, see timeout.c.
+struct timeout {
+  struct list_head list;       // In a slot of the wheel while pending
+  uint expires;                // Value of ticks to run at
+  void (*fn)(void*);
+  void* arg;
+};
+
+#endif
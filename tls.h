@@ -0,0 +1,15 @@
+// Thread-local storage, as laid out by i386 ELF (TLS variant II).
+//
+// %gs points at the thread control block; the thread's copy of
+// the program's PT_TLS segment ends right below it, which is
+// where code compiled with __thread looks for it.  exec() builds
+// the block for the first thread, the thread library builds one
+// for each thread it creates and passes it to clone() along with
+// CLONE_SETTLS.
+struct tls_tcb {
+  struct tls_tcb* self;  // %gs:0, as the compiler expects
+  uint image;            // Initial values of the .tdata part
+  uint filesz;           // Size of .tdata
+  uint size;             // Size of .tdata and .tbss, rounded to align
+  uint align;
+};
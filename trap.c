@@ -51,9 +51,17 @@ trap(struct trapframe *tf)
     if(cpu->id == 0){
       acquire(&tickslock);
       ticks++;
-      wakeup(&ticks);
       release(&tickslock);
+      timeout_run();
     }
+    cpu->ticks++;
+    if(proc == 0)
+      cpu->idle_ticks++;
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_RESCHED:
+    // Nothing to do, scheduler() looks at its runqueue again.
+    cpu->wakeups++;
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -107,7 +115,8 @@ trap(struct trapframe *tf)
 
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
-  if(proc && proc->state == RUNNING && tf->trapno == T_IRQ0+IRQ_TIMER)
+  if(proc && proc->state == RUNNING && tf->trapno == T_IRQ0+IRQ_TIMER &&
+     sched_tick())
     yield();
 
   // Check if the process has been killed since we yielded
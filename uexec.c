@@ -1,11 +1,37 @@
 #include "user.h"
 #include "errno.h"
+#include "spawn.h"
 
-int
-execvpe(const char *file, char *const argv[], char *const envp[])
+// What to run once a program's path is known.
+struct command {
+  char *const *argv;
+  char *const *envp;
+  const posix_spawn_file_actions_t *fa;
+  int pid;
+};
+
+static int
+run_exec(const char *path, struct command *c)
+{
+  return execve(path, c->argv, c->envp);
+}
+
+static int
+run_spawn(const char *path, struct command *c)
+{
+  return (c->pid = spawn(path, c->fa, c->argv, c->envp)) < 0 ? -1 : 0;
+}
+
+// Run the program file, looking for it in the directories of PATH
+// unless it has a slash in it.  run() returns 0 on success, and -1
+// with errno set if the program couldn't be started.  Nothing is
+// allocated, so the child of vfork() may use this too.
+static int
+search_path(const char *file, int (*run)(const char*, struct command*),
+    struct command *c)
 {
   if (strchr(file, '/')) {
-    return execve(file, argv, envp);
+    return run(file, c);
   }
   const char* path = getenv("PATH");
   if (path == 0) { // Path is empty, abort
@@ -14,9 +40,8 @@ execvpe(const char *file, char *const argv[], char *const envp[])
   }
   int pathlen = strlen(path);
   int len = strlen(file);
-  char* name = (char*)malloc(len + pathlen + 2);
-  char* path_malloc;
-  path_malloc = name = memmove(name + pathlen + 1, (char*)file, len + 1);
+  char buf[len + pathlen + 2];
+  char* name = memmove(buf + pathlen + 1, (char*)file, len + 1);
   *--name = '/';
   const char* p = path;
   int got_eacces = 0;
@@ -32,7 +57,9 @@ execvpe(const char *file, char *const argv[], char *const envp[])
     else {
       startp = (char*)memmove(name - (p - path), (char*)path, p - path);
     }
-    execve(startp, argv, envp);
+    if (run(startp, c) == 0) {
+      return 0;
+    }
     switch (errno) {
       case EACCES:
         // Record the we got a `Permission denied' error. If we end
@@ -64,7 +91,129 @@ execvpe(const char *file, char *const argv[], char *const envp[])
   if (got_eacces) {
     errno = EACCES;
   }
-
-  free(path_malloc);
   return -1;
 }
+
+int
+execvpe(const char *file, char *const argv[], char *const envp[])
+{
+  struct command c = { argv, envp, 0, 0 };
+  return search_path(file, run_exec, &c);
+}
+
+// Start path in a new process, after doing the file actions in fa
+// if it isn't null.  Unlike fork() and execve(), this doesn't copy
+// our memory.  Returns 0 and the pid of the child in *pid, or an
+// error number if the program couldn't be started, in which case
+// there is no child to wait for.  Spawn attributes are not
+// supported, attrp must be null.
+int
+posix_spawn(int *pid, const char *path, const posix_spawn_file_actions_t *fa,
+    const void *attrp, char *const argv[], char *const envp[])
+{
+  struct command c = { argv, envp, fa, 0 };
+
+  if (attrp) {
+    return EINVAL;
+  }
+  if (run_spawn(path, &c) < 0) {
+    return errno;
+  }
+  if (pid) {
+    *pid = c.pid;
+  }
+  return 0;
+}
+
+// Like posix_spawn(), looking for file in PATH as execvpe() does.
+int
+posix_spawnp(int *pid, const char *file, const posix_spawn_file_actions_t *fa,
+    const void *attrp, char *const argv[], char *const envp[])
+{
+  struct command c = { argv, envp, fa, 0 };
+
+  if (attrp) {
+    return EINVAL;
+  }
+  if (search_path(file, run_spawn, &c) < 0) {
+    return errno;
+  }
+  if (pid) {
+    *pid = c.pid;
+  }
+  return 0;
+}
+
+int
+posix_spawn_file_actions_init(posix_spawn_file_actions_t *fa)
+{
+  fa->n = 0;
+  return 0;
+}
+
+int
+posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *fa)
+{
+  fa->n = 0;
+  return 0;
+}
+
+static struct spawn_action*
+add_action(posix_spawn_file_actions_t *fa, int op, int fd)
+{
+  if (fa->n >= SPAWN_MAXACTIONS) {
+    return 0;
+  }
+  struct spawn_action* a = &fa->actions[fa->n++];
+  memset(a, 0, sizeof(*a));
+  a->op = op;
+  a->fd = fd;
+  return a;
+}
+
+// path is not copied and must stay valid until posix_spawn().
+int
+posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *fa, int fd,
+    const char *path, int oflag, int mode)
+{
+  struct spawn_action* a;
+
+  if (fd < 0) {
+    return EBADF;
+  }
+  if ((a = add_action(fa, SPAWN_OPEN, fd)) == 0) {
+    return ENOMEM;
+  }
+  a->path = (char*)path;
+  a->oflag = oflag;
+  a->mode = mode;
+  return 0;
+}
+
+int
+posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *fa, int fd)
+{
+  if (fd < 0) {
+    return EBADF;
+  }
+  if (add_action(fa, SPAWN_CLOSE, fd) == 0) {
+    return ENOMEM;
+  }
+  return 0;
+}
+
+int
+posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *fa, int fd,
+    int newfd)
+{
+  struct spawn_action* a;
+
+  if (fd < 0 || newfd < 0) {
+    return EBADF;
+  }
+  if ((a = add_action(fa, SPAWN_DUP2, fd)) == 0) {
+    return ENOMEM;
+  }
+  a->newfd = newfd;
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include "clone_flags.h"
 
 char **environ = 0;
+__thread int errno;
 
 char*
 strcpy(char *s, char *t)
@@ -193,9 +194,15 @@ getenv(const char *name)
 #define STACKSIZE 4096
 
 int
-clone_fn(int (*fn)(void*), void* stack, void* arg)
+clone_fn(int (*fn)(void*), void* stack, void* arg, void* tls,
+    volatile int* ctid)
 {
   int retval;
+  int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_THREAD;
+  if (tls != 0)
+    flags |= CLONE_SETTLS;
+  if (ctid != 0)
+    flags |= CLONE_CHILD_CLEARTID;
   if (stack == 0)
   {
     stack = (void*)malloc(STACKSIZE);
@@ -204,6 +211,8 @@ clone_fn(int (*fn)(void*), void* stack, void* arg)
   stack = (void*)(((void**)stack) - 1);
   *(void**)stack = arg;
   __asm__ __volatile__(
+      "pushl %7\n\t"
+      "pushl %6\n\t"
       "pushl %5\n\t"
       "pushl %4\n\t"
       "pushl %1\n\t"
@@ -218,7 +227,9 @@ clone_fn(int (*fn)(void*), void* stack, void* arg)
       :"0" (SYS_clone),"i" (SYS__exit),
       "r" (fn),
       "b" (stack),
-      "c" (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_THREAD));
+      "c" (flags),
+      "d" (tls),
+      "S" (ctid));
   if (retval < 0)
   {
     errno = -retval;
@@ -232,3 +243,27 @@ exit(void)
 {
   exit_group();
 }
+
+// Returns the new nice value, or -1 with errno set.
+int
+nice(int inc)
+{
+  int r = _nice(inc);
+  if (r < 0) {
+    return -1;
+  }
+  return 20 - r;
+}
+
+// Returns the nice value of the process, or -1 with errno set.
+// -1 is also a valid nice value: clear errno before the call
+// to tell them apart.
+int
+getpriority(int which, int who)
+{
+  int r = _getpriority(which, who);
+  if (r < 0) {
+    return -1;
+  }
+  return 20 - r;
+}
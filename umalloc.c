@@ -2,89 +2,354 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "usync.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with size classes and per-thread caches.
+//
+// Small blocks (up to MAXSMALL bytes with their header) are rounded
+// up to one of NCLASS sizes and carved out of spans, runs of pages
+// holding blocks of a single class.  Each thread keeps a few free
+// blocks of every class in a cache of its own, so most malloc and
+// free calls take no lock at all.  Caches are refilled from, and
+// overflow into, the spans' free lists, under a single lock.
+//
+// Larger blocks get a run of pages to themselves.  Free runs are
+// kept in address order and merged with their neighbours, and a
+// large enough free run at the top of the heap is given back to
+// the kernel with sbrk().
 
-typedef long Align;
+#define PGSIZE 4096
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define NCLASS 28
+#define MAXSMALL 4096
+#define SPAN_PAGES 4       // Minimum size of a span
+#define GROW_PAGES 16      // Minimum amount to ask sbrk() for
+#define TRIM_PAGES 32      // Free pages at the top worth giving back
+
+#define SPAN_LARGE NCLASS  // span->class of a large block
+#define SPAN_FREE (NCLASS + 1)  // span->class of a free run
+
+// Header of a run of pages: a span, a large block or a free run.
+struct span {
+  struct span *next;       // In its class's list or in freeruns
+  struct span *prev;
+  uint npages;
+  uint class;
+  uint live;               // Blocks out of this span
+  struct header *free;     // Free blocks of this span
+  char *bump;              // Not yet carved part of the span
+  char *end;
 };
 
-typedef union header Header;
+#define SPAN_HDR ((sizeof(struct span) + 15) & ~15)
 
-static Header base;
-static Header *freep;
+// Header of every block, just before the pointer malloc returns.
+struct header {
+  struct span *span;
+  uint class;
+};
 
-void
-free(void *ap)
+// A free block is linked to the next one through the first word
+// after its header; the header itself stays as it is.
+#define NEXT(h) (*(struct header**)((h) + 1))
+
+// Free blocks cached by one thread.
+struct tcache {
+  struct header *list[NCLASS];
+  uint count[NCLASS];
+};
+
+static __thread struct tcache tcache;
+
+static struct thread_mutex heap_lock;
+static struct span classes[NCLASS];  // Spans with blocks left
+static struct span freeruns;         // Free runs by address
+static char *heap_end;               // Where our last sbrk() ended
+
+static uint
+size_class(uint n)
 {
-  Header *bp, *p;
+  if(n <= 128)
+    return (n - 1) >> 4;
+  int b = 31 - __builtin_clz(n - 1);
+  return 8 + (b - 7) * 4 + (((n - 1) >> (b - 2)) & 3);
+}
 
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
-}
-
-static Header*
-morecore(uint nu)
+static uint
+class_size(uint c)
+{
+  if(c < 8)
+    return (c + 1) * 16;
+  uint g = (c - 8) / 4;
+  return (128 << g) + ((c - 8) % 4 + 1) * (32 << g);
+}
+
+// Up to how many blocks of class c a thread cache holds.
+static uint
+cache_limit(uint c)
+{
+  uint n = 16384 / class_size(c);
+  return n < 4 ? 4 : (n > 64 ? 64 : n);
+}
+
+static void
+list_init(struct span *head)
+{
+  head->next = head->prev = head;
+}
+
+static void
+list_remove(struct span *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+  s->next = s->prev = s;
+}
+
+static void
+list_insert_after(struct span *pos, struct span *s)
+{
+  s->next = pos->next;
+  s->prev = pos;
+  pos->next->prev = s;
+  pos->next = s;
+}
+
+static void
+heap_init(void)
+{
+  static int ready;
+
+  if(ready)
+    return;
+  for(int c = 0; c < NCLASS; c++)
+    list_init(&classes[c]);
+  list_init(&freeruns);
+  ready = 1;
+}
+
+// Put a run of pages back among the free runs, merging it with its
+// neighbours, and trim the heap if it ends up at the top.
+static void
+release_pages(struct span *s)
+{
+  struct span *p;
+
+  s->class = SPAN_FREE;
+  for(p = freeruns.prev; p != &freeruns && p > s; p = p->prev)
+    ;
+  list_insert_after(p, s);
+  if((char*)s + s->npages*PGSIZE == (char*)s->next){
+    struct span *next = s->next;
+    s->npages += next->npages;
+    list_remove(next);
+  }
+  if(p != &freeruns && (char*)p + p->npages*PGSIZE == (char*)s){
+    p->npages += s->npages;
+    list_remove(s);
+    s = p;
+  }
+  if(s->next == &freeruns && s->npages >= TRIM_PAGES &&
+     (char*)s + s->npages*PGSIZE == heap_end && sbrk(0) == heap_end){
+    uint n = s->npages*PGSIZE;
+    list_remove(s);
+    if(sbrk(-n) != (char*)-1)
+      heap_end -= n;
+    else
+      list_insert_after(freeruns.prev, s);
+  }
+}
+
+// Grow the heap by at least npages pages.
+static int
+morecore(uint npages)
 {
   char *p;
-  Header *hp;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
+  if(npages < GROW_PAGES)
+    npages = GROW_PAGES;
+  p = sbrk(0);
+  if((uint)p % PGSIZE && sbrk(PGSIZE - (uint)p % PGSIZE) == (char*)-1)
+    return -1;
+  p = sbrk(npages*PGSIZE);
   if(p == (char*)-1)
+    return -1;
+  heap_end = p + npages*PGSIZE;
+  struct span *s = (struct span*)p;
+  s->npages = npages;
+  release_pages(s);
+  return 0;
+}
+
+// Take a run of npages pages off the free runs, first fit.
+static struct span*
+alloc_pages(uint npages)
+{
+  struct span *s;
+
+  for(;;){
+    for(s = freeruns.next; s != &freeruns; s = s->next){
+      if(s->npages < npages)
+        continue;
+      if(s->npages > npages){
+        struct span *rest = (struct span*)((char*)s + npages*PGSIZE);
+        rest->npages = s->npages - npages;
+        rest->class = SPAN_FREE;
+        list_insert_after(s, rest);
+      }
+      list_remove(s);
+      s->npages = npages;
+      return s;
+    }
+    if(morecore(npages) < 0)
+      return 0;
+  }
+}
+
+static struct span*
+new_span(uint c)
+{
+  uint size = class_size(c);
+  uint npages = (SPAN_HDR + 8*size + PGSIZE - 1) / PGSIZE;
+  struct span *s;
+
+  if(npages < SPAN_PAGES)
+    npages = SPAN_PAGES;
+  if((s = alloc_pages(npages)) == 0)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  s->class = c;
+  s->live = 0;
+  s->free = 0;
+  s->bump = (char*)s + SPAN_HDR;
+  s->end = (char*)s + npages*PGSIZE;
+  list_insert_after(&classes[c], s);
+  return s;
+}
+
+// Move up to n free blocks of class c into this thread's cache.
+static void
+refill(uint c, uint n)
+{
+  struct tcache *tc = &tcache;
+  uint size = class_size(c);
+  struct header *h;
+
+  thread_mutex_lock(&heap_lock);
+  heap_init();
+  while(n > 0){
+    struct span *s = classes[c].next;
+    if(s == &classes[c] && (s = new_span(c)) == 0)
+      break;
+    while(n > 0 && (s->free || s->bump + size <= s->end)){
+      if(s->free){
+        h = s->free;
+        s->free = NEXT(h);
+      } else {
+        h = (struct header*)s->bump;
+        s->bump += size;
+        h->span = s;
+        h->class = c;
+      }
+      NEXT(h) = tc->list[c];
+      tc->list[c] = h;
+      tc->count[c]++;
+      s->live++;
+      n--;
+    }
+    if(s->free == 0 && s->bump + size > s->end)
+      list_remove(s);
+  }
+  thread_mutex_unlock(&heap_lock);
+}
+
+// Give n blocks of class c from this thread's cache back to
+// their spans.  A span with no blocks out goes back to the free
+// runs; thread caches keep this from happening on every free.
+static void
+flush(uint c, uint n)
+{
+  struct tcache *tc = &tcache;
+  uint size = class_size(c);
+  struct header *h;
+
+  thread_mutex_lock(&heap_lock);
+  while(n-- > 0 && (h = tc->list[c]) != 0){
+    tc->list[c] = NEXT(h);
+    tc->count[c]--;
+    struct span *s = h->span;
+    if(s->free == 0 && s->bump + size > s->end)
+      list_insert_after(&classes[c], s);
+    NEXT(h) = s->free;
+    s->free = h;
+    if(--s->live == 0){
+      list_remove(s);
+      release_pages(s);
+    }
+  }
+  thread_mutex_unlock(&heap_lock);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct header *h;
+  uint n = nbytes + sizeof(struct header);
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(n < nbytes)
+    return 0;
+  if(n <= MAXSMALL){
+    struct tcache *tc = &tcache;
+    uint c = size_class(n);
+    if(tc->list[c] == 0)
+      refill(c, cache_limit(c) / 2);
+    if((h = tc->list[c]) == 0)
+      return 0;
+    tc->list[c] = NEXT(h);
+    tc->count[c]--;
+    return h + 1;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+  uint npages = (SPAN_HDR + n + PGSIZE - 1) / PGSIZE;
+  thread_mutex_lock(&heap_lock);
+  heap_init();
+  struct span *s = alloc_pages(npages);
+  if(s)
+    s->class = SPAN_LARGE;
+  thread_mutex_unlock(&heap_lock);
+  if(s == 0)
+    return 0;
+  h = (struct header*)((char*)s + SPAN_HDR);
+  h->span = s;
+  h->class = SPAN_LARGE;
+  return h + 1;
+}
+
+void
+free(void *ap)
+{
+  struct header *h;
+
+  if(ap == 0)
+    return;
+  h = (struct header*)ap - 1;
+  if(h->class == SPAN_LARGE){
+    thread_mutex_lock(&heap_lock);
+    release_pages(h->span);
+    thread_mutex_unlock(&heap_lock);
+    return;
   }
+  struct tcache *tc = &tcache;
+  uint c = h->class;
+  NEXT(h) = tc->list[c];
+  tc->list[c] = h;
+  if(++tc->count[c] > cache_limit(c))
+    flush(c, cache_limit(c) / 2);
+}
+
+// Give everything in this thread's cache back, for a thread that
+// is about to exit.
+void
+malloc_thread_exit(void)
+{
+  for(uint c = 0; c < NCLASS; c++)
+    flush(c, tcache.count[c]);
 }
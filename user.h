@@ -1,9 +1,11 @@
 #include "types.h"
 
 struct stat;
+struct sched_attr;
+struct posix_spawn_file_actions;
 
 char **environ;
-int errno;
+extern __thread int errno;
 
 // system calls
 int fork(void);
@@ -44,6 +46,18 @@ int sched_yield(void);
 int mount(char*, char*);
 int chroot(char*);
 char* mmap(char*, int, int, int, int, int);
+int _nice(int);
+int _getpriority(int, int);
+int setpriority(int, int, int);
+int sched_setattr(int, struct sched_attr*);
+int sched_getattr(int, struct sched_attr*);
+int sched_setaffinity(int, uint);
+int sched_getaffinity(int, uint*);
+int read_timeout(int, void*, int, int);
+int futex(volatile int*, int, int, int);
+int spawn(const char*, const struct posix_spawn_file_actions*, char* const*,
+    char* const*);
+int vfork(void);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -66,10 +80,30 @@ char* strrchr(const char *s, int c);
 char* strchrnul(const char *s, int c);
 char* getenv(const char *name);
 int execvpe(const char *file, char *const argv[], char *const envp[]);
-int clone_fn(int (*start_routine)(void*), void* stack, void *arg);
+int posix_spawn(int *pid, const char *path,
+    const struct posix_spawn_file_actions *fa, const void *attrp,
+    char *const argv[], char *const envp[]);
+int posix_spawnp(int *pid, const char *file,
+    const struct posix_spawn_file_actions *fa, const void *attrp,
+    char *const argv[], char *const envp[]);
+int posix_spawn_file_actions_init(struct posix_spawn_file_actions *fa);
+int posix_spawn_file_actions_destroy(struct posix_spawn_file_actions *fa);
+int posix_spawn_file_actions_addopen(struct posix_spawn_file_actions *fa,
+    int fd, const char *path, int oflag, int mode);
+int posix_spawn_file_actions_addclose(struct posix_spawn_file_actions *fa,
+    int fd);
+int posix_spawn_file_actions_adddup2(struct posix_spawn_file_actions *fa,
+    int fd, int newfd);
+int clone_fn(int (*start_routine)(void*), void* stack, void *arg, void* tls,
+    volatile int* ctid);
 int exit(void) __attribute__((noreturn));
+int nice(int);
+int getpriority(int, int);
 
 // thread.c
 int thread_create(thread_t* thread, void* (*fn)(void*), void* arg, int);
 int thread_join(thread_t thread, void** retval);
 int thread_detach(thread_t thread);
+
+// umalloc.c
+void malloc_thread_exit(void);
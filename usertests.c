@@ -7,6 +7,12 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "errno.h"
+#include "futex.h"
+#include "usync.h"
+#include "threadpool.h"
+#include "spawn.h"
+#include "elf.h"
 
 char buf[8192];
 char name[3];
@@ -326,6 +332,570 @@ pipe1(void)
   printf(1, "pipe1 ok\n");
 }
 
+// read_timeout on an empty pipe gives up after about the timeout,
+// and returns data that arrives before it.
+void
+pipetimeout(void)
+{
+  int fds[2], pid, start, elapsed;
+
+  if(pipe(fds) != 0){
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+  start = uptime();
+  if(read_timeout(fds[0], buf, 1, 10) != -1 || errno != ETIMEDOUT){
+    printf(1, "pipetimeout: empty read did not time out\n");
+    exit();
+  }
+  elapsed = uptime() - start;
+  if(elapsed < 10 || elapsed > 20){
+    printf(1, "pipetimeout: timed out after %d ticks\n", elapsed);
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    sleep(5);
+    write(fds[1], "x", 1);
+    exit();
+  } else if(pid < 0){
+    printf(1, "fork() failed\n");
+    exit();
+  }
+  if(read_timeout(fds[0], buf, 1, 1000) != 1 || buf[0] != 'x'){
+    printf(1, "pipetimeout: read failed\n");
+    exit();
+  }
+  wait();
+  close(fds[0]);
+  close(fds[1]);
+  printf(1, "pipetimeout ok\n");
+}
+
+void
+futextest(void)
+{
+  int word = 1, start, elapsed;
+
+  if(futex(&word, FUTEX_WAIT, 0, 0) != -1 || errno != EAGAIN){
+    printf(1, "futextest: wait on changed value did not fail\n");
+    exit();
+  }
+  start = uptime();
+  if(futex(&word, FUTEX_WAIT, 1, 10) != -1 || errno != ETIMEDOUT){
+    printf(1, "futextest: wait did not time out\n");
+    exit();
+  }
+  elapsed = uptime() - start;
+  if(elapsed < 10 || elapsed > 20){
+    printf(1, "futextest: timed out after %d ticks\n", elapsed);
+    exit();
+  }
+  if(futex(&word, FUTEX_WAKE, 1, 0) != 0){
+    printf(1, "futextest: woke up a waiter that does not exist\n");
+    exit();
+  }
+  if(futex((int*)((char*)&word + 1), FUTEX_WAKE, 1, 0) != -1 || errno != EINVAL){
+    printf(1, "futextest: unaligned address accepted\n");
+    exit();
+  }
+  printf(1, "futextest ok\n");
+}
+
+#define SYNCTHREADS 4
+#define SYNCROUNDS 100
+
+static struct thread_barrier sync_barrier;
+static struct thread_rwlock sync_rwlock;
+static struct thread_mutex sync_mutex;
+static struct thread_cond sync_cond;
+static struct sem sync_sem;
+static int sync_value, sync_done, sync_bad;
+
+void*
+syncworker(void* arg)
+{
+  for(int i = 0; i < SYNCROUNDS; i++){
+    thread_barrier_wait(&sync_barrier);
+    thread_rwlock_wrlock(&sync_rwlock);
+    sync_value++;
+    thread_rwlock_unlock(&sync_rwlock);
+    thread_rwlock_rdlock(&sync_rwlock);
+    if(sync_value <= i)
+      sync_bad = 1;
+    thread_rwlock_unlock(&sync_rwlock);
+  }
+  sem_post(&sync_sem);
+  thread_mutex_lock(&sync_mutex);
+  while(!sync_done)
+    thread_cond_wait(&sync_cond, &sync_mutex);
+  thread_mutex_unlock(&sync_mutex);
+  return 0;
+}
+
+// Threads synchronizing through usync.h.
+void
+synctest(void)
+{
+  thread_t threads[SYNCTHREADS];
+
+  thread_barrier_init(&sync_barrier, SYNCTHREADS);
+  sem_init(&sync_sem, 0);
+  for(int i = 0; i < SYNCTHREADS; i++){
+    if(thread_create(&threads[i], syncworker, 0, 0) < 0){
+      printf(1, "synctest: thread_create failed\n");
+      exit();
+    }
+  }
+  for(int i = 0; i < SYNCTHREADS; i++)
+    sem_wait(&sync_sem);
+  if(sem_trywait(&sync_sem) != -1 || errno != EAGAIN){
+    printf(1, "synctest: semaphore posted too many times\n");
+    exit();
+  }
+  if(sync_bad || sync_value != SYNCTHREADS * SYNCROUNDS){
+    printf(1, "synctest: value %d instead of %d\n", sync_value,
+           SYNCTHREADS * SYNCROUNDS);
+    exit();
+  }
+  thread_mutex_lock(&sync_mutex);
+  sync_done = 1;
+  thread_cond_broadcast(&sync_cond);
+  thread_mutex_unlock(&sync_mutex);
+  for(int i = 0; i < SYNCTHREADS; i++)
+    thread_join(threads[i], 0);
+  printf(1, "synctest ok\n");
+}
+
+static __thread int tls_value = 42;
+static __thread char tls_zeroed[64];
+
+void*
+tlsworker(void* arg)
+{
+  int id = (int)arg;
+
+  if(tls_value != 42 || tls_zeroed[0] != 0 || tls_zeroed[63] != 0)
+    return (void*)1;
+  tls_value = id;
+  tls_zeroed[0] = id;
+  // errno is thread-local too.
+  errno = id;
+  sleep(1);
+  if(tls_value != id || tls_zeroed[0] != id || errno != id)
+    return (void*)1;
+  return 0;
+}
+
+// __thread variables start with their initial values and
+// aren't shared between threads.
+void
+tlstest(void)
+{
+  thread_t threads[SYNCTHREADS];
+  void* ret;
+
+  tls_value = -1;
+  for(int i = 0; i < SYNCTHREADS; i++){
+    if(thread_create(&threads[i], tlsworker, (void*)(i + 1), 0) < 0){
+      printf(1, "tlstest: thread_create failed\n");
+      exit();
+    }
+  }
+  for(int i = 0; i < SYNCTHREADS; i++){
+    thread_join(threads[i], &ret);
+    if(ret != 0){
+      printf(1, "tlstest: thread %d saw a wrong value\n", i);
+      exit();
+    }
+  }
+  if(tls_value != -1){
+    printf(1, "tlstest: main thread's value changed\n");
+    exit();
+  }
+  printf(1, "tlstest ok\n");
+}
+
+static int pool_hits[1000];
+
+void
+poolbody(int lo, int hi, void *arg)
+{
+  for(int i = lo; i < hi; i++)
+    pool_hits[i]++;
+}
+
+// Every index is visited exactly once, across reused workers.
+void
+pooltest(void)
+{
+  if(pool_start(4) < 1){
+    printf(1, "pooltest: pool_start failed\n");
+    exit();
+  }
+  for(int round = 0; round < 10; round++)
+    parallel_for(0, 1000, 7, poolbody, 0);
+  pool_stop();
+  for(int i = 0; i < 1000; i++){
+    if(pool_hits[i] != 10){
+      printf(1, "pooltest: index %d visited %d times\n", i, pool_hits[i]);
+      exit();
+    }
+  }
+  printf(1, "pooltest ok\n");
+}
+
+// Parent and child share memory copy-on-write after fork, and
+// must not see each other's writes, whether made by user code or
+// by the kernel on their behalf.
+void
+cowtest(void)
+{
+  int n = 8*4096, fds[2], pid;
+  // Unsigned, so that the bytes compare equal to i % 251.
+  unsigned char *mem = (unsigned char*)sbrk(n);
+
+  if(mem == (unsigned char*)-1){
+    printf(1, "cowtest: sbrk failed\n");
+    exit();
+  }
+  for(int i = 0; i < n; i++)
+    mem[i] = i % 251;
+  if(pipe(fds) != 0){
+    printf(1, "cowtest: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "cowtest: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // The last page is left for the kernel to write into.
+    for(int i = 0; i < n - 4096; i += 4096)
+      mem[i] = 'c';
+    write(fds[1], "kkkk", 4);
+    if(read(fds[0], mem + n - 4096, 4) != 4 || mem[4096] != 'c' ||
+       mem[n - 4096] != 'k' || mem[n - 1] != (n - 1) % 251){
+      printf(1, "cowtest: child sees wrong data\n");
+    }
+    exit();
+  }
+  wait();
+  for(int i = 0; i < n; i++){
+    if(mem[i] != i % 251){
+      printf(1, "cowtest: parent's byte %d changed\n", i);
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-n);
+  printf(1, "cowtest ok\n");
+}
+
+// A vfork() child borrows our memory until it exits, and
+// posix_spawn() starts a program after doing its file actions.
+void
+spawntest(void)
+{
+  static char *args[] = { "echo", "spawned", 0 };
+  posix_spawn_file_actions_t fa;
+  volatile int borrowed = 0;
+  int pid, fd, n;
+
+  printf(stdout, "spawn test\n");
+  pid = vfork();
+  if(pid < 0){
+    printf(stdout, "spawntest: vfork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    borrowed = 1;
+    _exit();
+  }
+  if(borrowed != 1){
+    printf(stdout, "spawntest: vfork child has its own memory\n");
+    exit();
+  }
+  wait();
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, 1, "spawnout", O_CREATE|O_WRONLY,
+                                   0666);
+  if(posix_spawnp(&pid, "echo", &fa, 0, args, environ) != 0 ||
+     wait() != pid){
+    printf(stdout, "spawntest: posix_spawnp echo failed\n");
+    exit();
+  }
+  fd = open("spawnout", O_RDONLY);
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink("spawnout");
+  if(n != 8 || strncmp(buf, "spawned\n", 8) != 0){
+    printf(stdout, "spawntest: echo wrote %d bytes to the wrong place\n", n);
+    exit();
+  }
+
+  // A program that can't be started leaves no child behind.
+  if(posix_spawnp(&pid, "nonexistent", 0, 0, args, environ) != ENOENT ||
+     wait() != -1){
+    printf(stdout, "spawntest: spawning nonexistent didn't fail cleanly\n");
+    exit();
+  }
+  printf(stdout, "spawn test ok\n");
+}
+
+// Our own bss is read in on first touch, like the rest of the
+// program.  Reading the program itself into a part of it nobody
+// has touched yet must not wait for the program's inode, which
+// read() holds.
+static char pageinbuf[3*4096];
+
+void
+pageintest(void)
+{
+  struct elfhdr *elf = (struct elfhdr*)(pageinbuf + 4096 - 8);
+  int fd, n;
+
+  printf(stdout, "pagein test\n");
+  if((fd = open("/bin/usertests", O_RDONLY)) < 0){
+    printf(stdout, "pagein test: can't open /bin/usertests\n");
+    exit();
+  }
+  n = read(fd, (char*)elf, 2*4096);
+  close(fd);
+  if(n != 2*4096 || elf->magic != ELF_MAGIC){
+    printf(stdout, "pagein test: read %d bytes of ourselves\n", n);
+    exit();
+  }
+  if(pageinbuf[0] != 0 || pageinbuf[sizeof(pageinbuf) - 1] != 0){
+    printf(stdout, "pagein test: bss isn't zero\n");
+    exit();
+  }
+  printf(stdout, "pagein test ok\n");
+}
+
+static void
+copyfile(char *from, char *to)
+{
+  int in, out, n;
+
+  in = open(from, O_RDONLY);
+  out = open(to, O_CREATE|O_WRONLY, 0777);
+  if(in < 0 || out < 0){
+    printf(stdout, "copyfile %s to %s failed\n", from, to);
+    exit();
+  }
+  while((n = read(in, buf, sizeof(buf))) > 0)
+    write(out, buf, n);
+  close(in);
+  close(out);
+}
+
+// Run path with its output going into buf.
+static int
+runcapture(char *path, char *arg)
+{
+  char *args[] = { path, arg, 0 };
+  posix_spawn_file_actions_t fa;
+  int pid, fd, n;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, 1, "textout", O_CREATE|O_WRONLY,
+                                   0666);
+  if(posix_spawn(&pid, path, &fa, 0, args, environ) != 0 || wait() != pid)
+    return -1;
+  fd = open("textout", O_RDONLY);
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  unlink("textout");
+  if(n < 0)
+    return -1;
+  buf[n] = 0;
+  return n;
+}
+
+// Processes running the same program share its pages, which
+// must not outlive changes to the file.
+void
+textcachetest(void)
+{
+  printf(stdout, "text cache test\n");
+  copyfile("/bin/echo", "textprog");
+  if(runcapture("textprog", "once") < 0 || strcmp(buf, "once\n") != 0 ||
+     runcapture("textprog", "twice") < 0 || strcmp(buf, "twice\n") != 0){
+    printf(stdout, "text cache test: copy of echo doesn't echo\n");
+    exit();
+  }
+  copyfile("/bin/helloworld", "textprog");
+  if(runcapture("textprog", "again") < 0 ||
+     strcmp(buf, "Hello, world!\n") != 0){
+    printf(stdout, "text cache test: still running the old program\n");
+    exit();
+  }
+  unlink("textprog");
+  printf(stdout, "text cache test ok\n");
+}
+
+// Resident size of this process in bytes, from /proc/<pid>/memory.
+static int
+resident(void)
+{
+  char path[32], num[16], *p;
+  int fd, n, pid;
+
+  p = num + sizeof(num);
+  *--p = 0;
+  for(pid = getpid(); pid > 0; pid /= 10)
+    *--p = '0' + pid % 10;
+  strcpy(path, "/proc/");
+  strcpy(path + strlen(path), p);
+  strcpy(path + strlen(path), "/memory");
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf(stdout, "lazy sbrk test: can't open %s\n", path);
+    exit();
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n < 0 ? 0 : n] = 0;
+  if((p = strchr(buf, 'r')) == 0 || strncmp(p, "resident ", 9) != 0){
+    printf(stdout, "lazy sbrk test: bad %s: %s\n", path, buf);
+    exit();
+  }
+  return atoi(p + 9);
+}
+
+// sbrk() only promises memory; pages appear, zeroed, on first touch.
+void
+lazysbrktest(void)
+{
+  int amt = 4*1024*1024;
+  int before, grown, touched;
+  char *a;
+
+  printf(stdout, "lazy sbrk test\n");
+  before = resident();
+  if((a = sbrk(amt)) == (char*)-1){
+    printf(stdout, "lazy sbrk test: sbrk failed\n");
+    exit();
+  }
+  grown = resident();
+  a[0] = 1;
+  if(a[amt/2] != 0 || a[amt - 1] != 0){
+    printf(stdout, "lazy sbrk test: new memory isn't zero\n");
+    exit();
+  }
+  touched = resident();
+  sbrk(-amt);
+  if(grown - before > 4*4096){
+    printf(stdout, "lazy sbrk test: sbrk made %d bytes resident\n",
+           grown - before);
+    exit();
+  }
+  if(touched - grown < 3*4096){
+    printf(stdout, "lazy sbrk test: touching pages made %d bytes resident\n",
+           touched - grown);
+    exit();
+  }
+  printf(stdout, "lazy sbrk test ok\n");
+}
+
+// The free blocks /proc/buddyinfo reports add up to the free pages.
+void
+buddyinfotest(void)
+{
+  int fd, n, order, blocks, nfree, total;
+  char *p;
+
+  printf(stdout, "buddyinfo test\n");
+  if((fd = open("/proc/buddyinfo", O_RDONLY)) < 0){
+    printf(stdout, "buddyinfo test: can't open /proc/buddyinfo\n");
+    exit();
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n < 0 ? 0 : n] = 0;
+  total = 0;
+  for(p = buf; strncmp(p, "order ", 6) == 0; p = strchr(p, '\n') + 1){
+    order = atoi(p + 6);
+    blocks = atoi(strchr(p, ':') + 2);
+    total += blocks << order;
+  }
+  if(strncmp(p, "cached: ", 8) != 0){
+    printf(stdout, "buddyinfo test: bad /proc/buddyinfo: %s\n", buf);
+    exit();
+  }
+  total += atoi(p + 8);
+  if((fd = open("/proc/free_pages", O_RDONLY)) < 0){
+    printf(stdout, "buddyinfo test: can't open /proc/free_pages\n");
+    exit();
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n < 0 ? 0 : n] = 0;
+  nfree = atoi(buf);
+  // Other processes may allocate or free a little meanwhile.
+  if(total < nfree - 64 || total > nfree + 64){
+    printf(stdout, "buddyinfo test: %d pages in blocks, %d free\n",
+           total, nfree);
+    exit();
+  }
+  printf(stdout, "buddyinfo test ok\n");
+}
+
+// Total of the hits and misses in /proc/zeropool.
+static int
+zeroallocs(void)
+{
+  int fd, n;
+  char *h, *m;
+
+  if((fd = open("/proc/zeropool", O_RDONLY)) < 0){
+    printf(stdout, "zero pool test: can't open /proc/zeropool\n");
+    exit();
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n < 0 ? 0 : n] = 0;
+  if(strncmp(buf, "pages ", 6) != 0 || (h = strchr(buf, 'h')) == 0 ||
+     (m = strchr(buf, 'm')) == 0){
+    printf(stdout, "zero pool test: bad /proc/zeropool: %s\n", buf);
+    exit();
+  }
+  return atoi(h + 5) + atoi(m + 7);
+}
+
+// Fresh heap pages come from kalloc_zeroed(), and are zero.
+void
+zeropooltest(void)
+{
+  int npages = 16;
+  int before, after;
+  char *a;
+
+  printf(stdout, "zero pool test\n");
+  before = zeroallocs();
+  if((a = sbrk(npages*4096)) == (char*)-1){
+    printf(stdout, "zero pool test: sbrk failed\n");
+    exit();
+  }
+  for(int i = 0; i < npages; i++){
+    if(a[i*4096] != 0 || a[i*4096 + 4095] != 0){
+      printf(stdout, "zero pool test: page %d isn't zero\n", i);
+      exit();
+    }
+  }
+  after = zeroallocs();
+  sbrk(-npages*4096);
+  if(after - before < npages){
+    printf(stdout, "zero pool test: %d zeroed pages for %d faults\n",
+           after - before, npages);
+    exit();
+  }
+  printf(stdout, "zero pool test ok\n");
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(void)
@@ -1699,6 +2269,18 @@ main(int argc, char *argv[])
 
   mem();
   pipe1();
+  pipetimeout();
+  futextest();
+  synctest();
+  tlstest();
+  pooltest();
+  cowtest();
+  spawntest();
+  pageintest();
+  textcachetest();
+  lazysbrktest();
+  buddyinfotest();
+  zeropooltest();
   preempt();
   exitwait();
   rmdot();
@@ -0,0 +1,262 @@
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "errno.h"
+#include "futex.h"
+#include "usync.h"
+
+#define WAKE_ALL 0x7fffffff
+
+// Mutexes follow "Futexes Are Tricky" by Ulrich Drepper: the state
+// is 2 when there may be someone sleeping on it, so that unlocking
+// an uncontended mutex doesn't need a system call.
+
+void
+thread_mutex_init(struct thread_mutex* m)
+{
+  m->state = 0;
+}
+
+void
+thread_mutex_lock(struct thread_mutex* m)
+{
+  uint c = cmpxchg(&m->state, 0, 1);
+  if (c == 0) {
+    return;
+  }
+  if (c != 2) {
+    c = xchg(&m->state, 2);
+  }
+  while (c != 0) {
+    futex((volatile int*)&m->state, FUTEX_WAIT, 2, 0);
+    c = xchg(&m->state, 2);
+  }
+}
+
+int
+thread_mutex_trylock(struct thread_mutex* m)
+{
+  if (cmpxchg(&m->state, 0, 1) != 0) {
+    errno = EBUSY;
+    return -1;
+  }
+  return 0;
+}
+
+void
+thread_mutex_unlock(struct thread_mutex* m)
+{
+  if (fetch_add(&m->state, -1) != 1) {
+    m->state = 0;
+    futex((volatile int*)&m->state, FUTEX_WAKE, 1, 0);
+  }
+}
+
+// Relock a mutex after sleeping on a condition variable.  Others
+// may have gone to sleep on it meanwhile, so take it as contended.
+static void
+mutex_relock(struct thread_mutex* m)
+{
+  while (xchg(&m->state, 2) != 0) {
+    futex((volatile int*)&m->state, FUTEX_WAIT, 2, 0);
+  }
+}
+
+void
+thread_cond_init(struct thread_cond* c)
+{
+  c->seq = 0;
+  c->waiters = 0;
+}
+
+// Wait for at most timeout ticks, or forever if timeout is 0.
+// Like any condition variable wait, it may return early.
+int
+thread_cond_timedwait(struct thread_cond* c, struct thread_mutex* m,
+    int timeout)
+{
+  int result = 0;
+
+  atomic_add(&c->waiters, 1);
+  uint seq = c->seq;
+  thread_mutex_unlock(m);
+  if (futex((volatile int*)&c->seq, FUTEX_WAIT, seq, timeout) < 0 &&
+      errno == ETIMEDOUT) {
+    result = -1;
+  }
+  atomic_add(&c->waiters, -1);
+  mutex_relock(m);
+  if (result < 0) {
+    errno = ETIMEDOUT;
+  }
+  return result;
+}
+
+void
+thread_cond_wait(struct thread_cond* c, struct thread_mutex* m)
+{
+  thread_cond_timedwait(c, m, 0);
+}
+
+void
+thread_cond_signal(struct thread_cond* c)
+{
+  atomic_add(&c->seq, 1);
+  if (c->waiters) {
+    futex((volatile int*)&c->seq, FUTEX_WAKE, 1, 0);
+  }
+}
+
+void
+thread_cond_broadcast(struct thread_cond* c)
+{
+  atomic_add(&c->seq, 1);
+  if (c->waiters) {
+    futex((volatile int*)&c->seq, FUTEX_WAKE, WAKE_ALL, 0);
+  }
+}
+
+// Readers-writer locks prefer readers: a steady stream of readers
+// can keep a writer waiting.  Waiters of both kinds sleep on seq,
+// which is bumped when the lock becomes free.
+
+void
+thread_rwlock_init(struct thread_rwlock* rw)
+{
+  rw->state = 0;
+  rw->seq = 0;
+  rw->waiters = 0;
+}
+
+// Sleep until seq moves, unless the lock can be taken already:
+// by a writer if it is free, by a reader if no writer holds it.
+// Registering as a waiter before reading seq pairs with unlock
+// bumping seq before looking at waiters.
+static void
+rwlock_sleep(struct thread_rwlock* rw, int writer)
+{
+  atomic_add(&rw->waiters, 1);
+  uint seq = rw->seq;
+  uint s = rw->state;
+  if (writer ? s != 0 : s == RWLOCK_WRITER) {
+    futex((volatile int*)&rw->seq, FUTEX_WAIT, seq, 0);
+  }
+  atomic_add(&rw->waiters, -1);
+}
+
+void
+thread_rwlock_rdlock(struct thread_rwlock* rw)
+{
+  for (;;) {
+    uint s = rw->state;
+    if (s != RWLOCK_WRITER) {
+      if (cmpxchg(&rw->state, s, s + 1) == s) {
+        return;
+      }
+      continue;
+    }
+    rwlock_sleep(rw, 0);
+  }
+}
+
+void
+thread_rwlock_wrlock(struct thread_rwlock* rw)
+{
+  while (cmpxchg(&rw->state, 0, RWLOCK_WRITER) != 0) {
+    rwlock_sleep(rw, 1);
+  }
+}
+
+void
+thread_rwlock_unlock(struct thread_rwlock* rw)
+{
+  if (rw->state == RWLOCK_WRITER) {
+    rw->state = 0;
+  } else if (fetch_add(&rw->state, -1) != 1) {
+    // Other readers still hold it.
+    return;
+  }
+  atomic_add(&rw->seq, 1);
+  if (rw->waiters) {
+    futex((volatile int*)&rw->seq, FUTEX_WAKE, WAKE_ALL, 0);
+  }
+}
+
+int
+thread_barrier_init(struct thread_barrier* b, uint count)
+{
+  if (count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  b->count = count;
+  b->arrived = 0;
+  b->generation = 0;
+  return 0;
+}
+
+// The last thread to arrive starts a new generation, which lets
+// the others go and makes the barrier ready for the next round.
+int
+thread_barrier_wait(struct thread_barrier* b)
+{
+  uint generation = b->generation;
+  if (fetch_add(&b->arrived, 1) == b->count - 1) {
+    b->arrived = 0;
+    atomic_add(&b->generation, 1);
+    futex((volatile int*)&b->generation, FUTEX_WAKE, WAKE_ALL, 0);
+    return THREAD_BARRIER_SERIAL_THREAD;
+  }
+  while (b->generation == generation) {
+    futex((volatile int*)&b->generation, FUTEX_WAIT, generation, 0);
+  }
+  return 0;
+}
+
+int
+sem_init(struct sem* s, uint value)
+{
+  if (value > WAKE_ALL) {
+    errno = EINVAL;
+    return -1;
+  }
+  s->value = value;
+  s->waiters = 0;
+  return 0;
+}
+
+int
+sem_trywait(struct sem* s)
+{
+  for (;;) {
+    uint v = s->value;
+    if (v == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (cmpxchg(&s->value, v, v - 1) == v) {
+      return 0;
+    }
+  }
+}
+
+void
+sem_wait(struct sem* s)
+{
+  while (sem_trywait(s) < 0) {
+    atomic_add(&s->waiters, 1);
+    if (s->value == 0) {
+      futex((volatile int*)&s->value, FUTEX_WAIT, 0, 0);
+    }
+    atomic_add(&s->waiters, -1);
+  }
+}
+
+void
+sem_post(struct sem* s)
+{
+  atomic_add(&s->value, 1);
+  if (s->waiters) {
+    futex((volatile int*)&s->value, FUTEX_WAKE, 1, 0);
+  }
+}
@@ -0,0 +1,63 @@
+// Synchronization between threads (and processes sharing memory).
+//
+// Everything is a few words of memory, so objects can live in
+// globals, on the heap or in a MAP_SHARED mapping.  An object
+// that is all zeroes is ready to use, except for barriers and
+// semaphores which need thread_barrier_init() and sem_init().
+// Uncontended operations are a single atomic instruction; only
+// those that have to wait enter the kernel, through futex().
+
+struct thread_mutex {
+  volatile uint state;   // 0 unlocked, 1 locked, 2 locked and contended
+};
+
+struct thread_cond {
+  volatile uint seq;     // bumped by every signal and broadcast
+  volatile uint waiters;
+};
+
+struct thread_rwlock {
+  volatile uint state;   // number of readers, or RWLOCK_WRITER
+  volatile uint seq;     // bumped by every unlock that may let waiters in
+  volatile uint waiters;
+};
+
+struct thread_barrier {
+  uint count;            // threads to wait for
+  volatile uint arrived;
+  volatile uint generation;
+};
+
+struct sem {
+  volatile uint value;
+  volatile uint waiters;
+};
+
+#define RWLOCK_WRITER 0xffffffff
+
+// Returned by thread_barrier_wait() to exactly one of the threads.
+#define THREAD_BARRIER_SERIAL_THREAD 1
+
+void thread_mutex_init(struct thread_mutex*);
+void thread_mutex_lock(struct thread_mutex*);
+int thread_mutex_trylock(struct thread_mutex*);
+void thread_mutex_unlock(struct thread_mutex*);
+
+void thread_cond_init(struct thread_cond*);
+void thread_cond_wait(struct thread_cond*, struct thread_mutex*);
+int thread_cond_timedwait(struct thread_cond*, struct thread_mutex*, int);
+void thread_cond_signal(struct thread_cond*);
+void thread_cond_broadcast(struct thread_cond*);
+
+void thread_rwlock_init(struct thread_rwlock*);
+void thread_rwlock_rdlock(struct thread_rwlock*);
+void thread_rwlock_wrlock(struct thread_rwlock*);
+void thread_rwlock_unlock(struct thread_rwlock*);
+
+int thread_barrier_init(struct thread_barrier*, uint);
+int thread_barrier_wait(struct thread_barrier*);
+
+int sem_init(struct sem*, uint);
+void sem_wait(struct sem*);
+int sem_trywait(struct sem*);
+void sem_post(struct sem*);
@@ -6,10 +6,12 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 struct segdesc gdt[NSEGS];
+struct spinlock cowlock;  // Serializes breaking copy-on-write sharing
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
@@ -52,10 +54,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   if(*pde & PTE_P){
     pgtab = (pte_t*)p2v(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table 
     // entries, if necessary.
@@ -131,9 +132,8 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
   if (p2v(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
@@ -148,6 +148,7 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  initlock(&cowlock, "cow");
   kpgdir = setupkvm();
   switchkvm();
 }
@@ -170,9 +171,16 @@ switchuvm(struct proc *p)
   cpu->ts.ss0 = SEG_KDATA << 3;
   cpu->ts.esp0 = (uint)proc->kstack + KSTACKSIZE;
   ltr(SEG_TSS << 3);
-  if(p->mm == 0 || p->mm->pgdir == 0)
-    panic("switchuvm: no pgdir");
-  lcr3(v2p(p->mm->pgdir));  // switch to new address space
+  // Reloaded into %gs on the way back to user mode.
+  cpu->gdt[SEG_UTLS] = SEG(STA_W, p->tls, 0xffffffff, DPL_USER);
+  if(p->mm == 0){
+    // Kernel thread, it has no user address space.
+    lcr3(v2p(kpgdir));
+  } else {
+    if(p->mm->pgdir == 0)
+      panic("switchuvm: no pgdir");
+    lcr3(v2p(p->mm->pgdir));  // switch to new address space
+  }
   popcli();
 }
 
@@ -185,8 +193,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pgdir, 0, PGSIZE, v2p(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -196,6 +203,11 @@ set_pte_permissions(pde_t* pgdir, void* addr, uint perm)
 {
   pte_t* entry = walkpgdir(pgdir, addr, 0);
   if (entry == 0) return 0;
+  // Don't let a page shared with another process become writable.
+  if ((perm & PTE_W) && (*entry & PTE_COW) &&
+      cowpage(pgdir, (uint)addr) < 0) {
+    return 0;
+  }
   // Clear read, write and execute permissions on the entry.
   *entry = (*entry & ~0xFFF) | (perm & 0xFFF);
   return 1;
@@ -248,13 +260,12 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz, uint perm)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     mappages(pgdir, (char*)a, PGSIZE, v2p(mem), perm);
   }
   return newsz;
@@ -323,9 +334,12 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  If cow is set, writable pages are shared
+// read-only and copied by the first of the two to write to them,
+// see cowpage().  pgdir must be the current page table, and no
+// other CPU may be using it: the parent loses write access too.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, int cow)
 {
   pde_t *d;
   pte_t *pte;
@@ -335,16 +349,23 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
+    // Pages not read in yet are read in by the child too.
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+      continue;
     if(*pte & PTE_MMAP) {
       // We will copy shared mmaps in copy_mmap.
       continue;
     }
-    if(!(*pte & PTE_P)) {
-      panic("copyuvm: page not present");
-    }
+    if(!(*pte & PTE_P))
+      continue;
     pa = PTE_ADDR(*pte);
+    if(cow && (*pte & (PTE_W | PTE_COW))){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      if(mappages(d, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte)) < 0)
+        goto bad;
+      kref(p2v(pa));
+      continue;
+    }
     flags = PTE_FLAGS(*pte);
     if((mem = kalloc()) == 0)
       goto bad;
@@ -352,13 +373,189 @@ copyuvm(pde_t *pgdir, uint sz)
     if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
       goto bad;
   }
+  if(cow)
+    lcr3(v2p(pgdir));
   return d;
 
 bad:
+  if(cow)
+    lcr3(v2p(pgdir));
   freevm(d);
   return 0;
 }
 
+// Give the copy-on-write page at va its own copy of the memory,
+// or just make it writable if nobody else uses it any more.
+// Returns -1 if out of memory.
+int
+cowpage(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *mem, *old;
+
+  acquire(&cowlock);
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || !(*pte & PTE_COW)){
+    // Somebody sharing pgdir was first.
+    release(&cowlock);
+    return 0;
+  }
+  old = p2v(PTE_ADDR(*pte));
+  if(krefs(old) > 1){
+    if((mem = kalloc()) == 0){
+      release(&cowlock);
+      return -1;
+    }
+    memmove(mem, old, PGSIZE);
+    *pte = v2p(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+    kfree(old);
+  } else {
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+  }
+  release(&cowlock);
+  if(proc && proc->mm && proc->mm->pgdir == pgdir)
+    lcr3(v2p(pgdir));
+  return 0;
+}
+
+// Break all copy-on-write sharing of pgdir, before another thread
+// starts using it: once several CPUs may have its pages in their
+// TLBs, replacing a page behind their back is no longer safe.
+int
+unsharecow(pde_t *pgdir, uint sz)
+{
+  pte_t *pte;
+  uint i;
+
+  for(i = 0; i < sz; i += PGSIZE){
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) != 0 && (*pte & PTE_COW) &&
+       cowpage(pgdir, i) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Read in the page at va if exec left it to be loaded on first
+// touch: whatever the regions covering it have of the file, and
+// zeroes around that.  Any other page below mm->sz is heap that
+// sbrk() has only promised so far, and gets a zeroed page.
+// Returns -1 if va is past the end or there is no memory for it.
+int
+pagein(struct mm_struct *mm, uint va)
+{
+  struct mm_region *r, *whole;
+  uint perm, from, to;
+  int shared;
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  perm = 0;
+  whole = 0;
+  for(r = mm->region; r < mm->region + mm->nregion; r++){
+    if(r->start <= va && va < r->end){
+      perm |= r->perm;
+      if(r->vaddr <= va && va + PGSIZE <= r->vaddr + r->filesz)
+        whole = r;
+    }
+  }
+  shared = 0;
+  if(perm == 0){
+    if(va >= mm->sz || (mem = kalloc_zeroed()) == 0)
+      return -1;
+    perm = PTE_W | PTE_U;
+    goto map;
+  }
+again:
+  ilock(mm->exe);
+  // A page that is all file contents is the same in every process
+  // running the program: map the one in the text page cache.
+  // Writes would go through copy-on-write, which isn't safe once
+  // threads share the mm (see copy_mm()), so they get a copy.
+  mem = 0;
+  if(whole && (!(perm & PTE_W) || mm->users == 1) &&
+     (mem = textpage(mm->exe, whole->off + (va - whole->vaddr))) != 0){
+    shared = 1;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  }
+  if(mem == 0){
+    if((mem = kalloc_zeroed()) == 0){
+      iunlock(mm->exe);
+      return -1;
+    }
+    for(r = mm->region; r < mm->region + mm->nregion; r++){
+      if(va < r->start || va >= r->end)
+        continue;
+      from = va > r->vaddr ? va : r->vaddr;
+      to = va + PGSIZE < r->vaddr + r->filesz ? va + PGSIZE :
+                                                r->vaddr + r->filesz;
+      if(from < to && readi(mm->exe, mem + (from - va),
+                            r->off + (from - r->vaddr), to - from) != to - from){
+        iunlock(mm->exe);
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+  iunlock(mm->exe);
+
+map:
+  // Another thread may have read it in meanwhile.
+  acquire(&mm->lock);
+  if((pte = walkpgdir(mm->pgdir, (char*)va, 1)) == 0 || (*pte & PTE_P)){
+    release(&mm->lock);
+    kfree(mem);
+    return pte ? 0 : -1;
+  }
+  if(shared && (perm & PTE_COW) && mm->users > 1){
+    // A thread was started meanwhile.
+    release(&mm->lock);
+    kfree(mem);
+    perm = (perm & ~PTE_COW) | PTE_W;
+    shared = 0;
+    goto again;
+  }
+  *pte = v2p(mem) | perm | PTE_P;
+  release(&mm->lock);
+  return 0;
+}
+
+// Read in the pages of [va, va+n) that are still to be loaded, for
+// the kernel to use them where it can't sleep in a page fault.
+int
+pagein_range(struct mm_struct *mm, uint va, uint n)
+{
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(mm->pgdir, (char*)a, 0);
+    if((pte == 0 || !(*pte & PTE_P)) && pagein(mm, a) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// How many of the pages below sz are actually there, as opposed
+// to left for pagein() to fill in on first touch.
+uint
+uvmrss(pde_t *pgdir, uint sz)
+{
+  pte_t *pte;
+  uint a, n;
+
+  n = 0;
+  for(a = 0; a < sz; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(!pte)
+      a += (NPTENTRIES - 1) * PGSIZE;
+    else if(*pte & PTE_P)
+      n++;
+  }
+  return n;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -367,7 +564,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -382,12 +579,25 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if((pte == 0 || !(*pte & PTE_P)) && proc && proc->mm &&
+       pgdir == proc->mm->pgdir && va0 < proc->mm->sz){
+      if(pagein(proc->mm, va0) < 0)
+        return -1;
+      pte = walkpgdir(pgdir, (char*)va0, 0);
+    }
+    // The kernel mapping ignores copy-on-write, break it by hand.
+    if(pte && (*pte & PTE_COW) && cowpage(pgdir, va0) < 0)
+      return -1;
+    // Nor does it know about read-only pages, such as program text
+    // shared with other processes.
     pa0 = uva2ka(pgdir, (char*)va0);
-    if(pa0 == 0)
+    if(pa0 == 0 || !(*pte & PTE_W))
       return -1;
     n = PGSIZE - (va - va0);
     if(n > len)
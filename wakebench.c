@@ -0,0 +1,110 @@
+// Measure the cost of sleep/wakeup while more and more
+// processes sleep on unrelated channels.
+// With hashed waitqueues the time per round trip should
+// not depend on the number of idle sleepers.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define MAXSLEEPERS 48
+#define ROUNDTRIPS 5000
+
+// Fork n children that block reading their own pipe.
+// Their write ends are stored in fds; closing them
+// makes the children see EOF and exit.
+int
+spawn_sleepers(int n, int* fds)
+{
+  int p[2];
+  char c;
+
+  for(int i = 0; i < n; i++){
+    if(pipe(p) < 0){
+      printf(2, "wakebench: pipe failed\n");
+      return i;
+    }
+    int pid = fork();
+    if(pid < 0){
+      printf(2, "wakebench: fork failed\n");
+      close(p[0]);
+      close(p[1]);
+      return i;
+    }
+    if(pid == 0){
+      // Don't keep the other sleepers' pipes open.
+      for(int j = 0; j < i; j++)
+        close(fds[j]);
+      close(p[1]);
+      read(p[0], &c, 1);
+      exit();
+    }
+    close(p[0]);
+    fds[i] = p[1];
+  }
+  return n;
+}
+
+void
+reap_sleepers(int n, int* fds)
+{
+  for(int i = 0; i < n; i++)
+    close(fds[i]);
+  for(int i = 0; i < n; i++)
+    wait();
+}
+
+// Bounce a byte between two processes through a pair of pipes,
+// every hop is one sleep and one wakeup.
+int
+pingpong(int rounds)
+{
+  int to[2], from[2];
+  char c = 'x';
+
+  if(pipe(to) < 0 || pipe(from) < 0){
+    printf(2, "wakebench: pipe failed\n");
+    return -1;
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf(2, "wakebench: fork failed\n");
+    return -1;
+  }
+  if(pid == 0){
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit();
+  }
+  close(to[0]);
+  close(from[1]);
+  int start = uptime();
+  for(int i = 0; i < rounds; i++){
+    write(to[1], &c, 1);
+    read(from[0], &c, 1);
+  }
+  int elapsed = uptime() - start;
+  close(to[1]);
+  close(from[0]);
+  wait();
+  return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fds[MAXSLEEPERS];
+
+  printf(1, "wakebench: %d round trips\n", ROUNDTRIPS);
+  for(int n = 0; n <= MAXSLEEPERS; n += 16){
+    int spawned = spawn_sleepers(n, fds);
+    int ticks = pingpong(ROUNDTRIPS);
+    printf(1, "%d sleepers: %d ticks\n", spawned, ticks);
+    reap_sleepers(spawned, fds);
+    if(spawned < n)
+      break;
+  }
+  exit();
+}
@@ -1,12 +1,19 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "threadpool.h"
 
-char buf[512];
+struct count {
+  char *name;
+  int l, w, c;
+  int error;   // Nonzero if the file couldn't be opened or read
+};
 
-void
-wc(int fd, char *name)
+// Returns -1 on a read error.
+int
+count(int fd, struct count *cnt)
 {
+  char buf[512];
   int i, n;
   int l, w, c, inword;
 
@@ -25,30 +32,77 @@ wc(int fd, char *name)
       }
     }
   }
-  if(n < 0){
+  cnt->l = l;
+  cnt->w = w;
+  cnt->c = c;
+  return n < 0 ? -1 : 0;
+}
+
+void
+wc(int fd, char *name)
+{
+  struct count cnt;
+
+  if(count(fd, &cnt) < 0){
     printf(1, "wc: read error\n");
     exit();
   }
-  printf(1, "%d %d %d %s\n", l, w, c, name);
+  printf(1, "%d %d %d %s\n", cnt.l, cnt.w, cnt.c, name);
+}
+
+// Count files lo to hi-1, for the thread pool.
+void
+count_files(int lo, int hi, void *arg)
+{
+  struct count *counts = arg;
+  int fd;
+
+  for(int i = lo; i < hi; i++){
+    if((fd = open(counts[i].name, 0)) < 0){
+      counts[i].error = 1;
+      continue;
+    }
+    if(count(fd, &counts[i]) < 0)
+      counts[i].error = 2;
+    close(fd);
+  }
 }
 
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  struct count *counts;
+  int i, n;
 
   if(argc <= 1){
     wc(0, "");
     exit();
   }
 
+  // Count the files in parallel, print the results in order.
+  if((counts = malloc(argc * sizeof(*counts))) == 0){
+    printf(1, "wc: out of memory\n");
+    exit();
+  }
+  memset(counts, 0, argc * sizeof(*counts));
+  for(i = 1; i < argc; i++)
+    counts[i].name = argv[i];
+  n = pool_ncpu();
+  pool_start(argc - 1 < n ? argc - 1 : n);
+  parallel_for(1, argc, 1, count_files, counts);
+  pool_stop();
+
   for(i = 1; i < argc; i++){
-    if((fd = open(argv[i], 0)) < 0){
+    if(counts[i].error == 1){
       printf(1, "wc: cannot open %s\n", argv[i]);
       exit();
     }
-    wc(fd, argv[i]);
-    close(fd);
+    if(counts[i].error == 2){
+      printf(1, "wc: read error\n");
+      exit();
+    }
+    printf(1, "%d %d %d %s\n", counts[i].l, counts[i].w, counts[i].c,
+           argv[i]);
   }
   exit();
 }
@@ -117,6 +117,49 @@ sti(void)
   asm volatile("sti");
 }
 
+static inline void
+atomic_add(volatile uint *addr, uint v)
+{
+  asm volatile("lock; addl %1, %0" :
+               "+m" (*addr) :
+               "ir" (v) :
+               "cc");
+}
+
+// Atomically add v to *addr and return the old value.
+static inline uint
+fetch_add(volatile uint *addr, uint v)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (v), "+m" (*addr) :
+               :
+               "cc", "memory");
+  return v;
+}
+
+// Atomically set *addr to newval if it holds expected.
+// Returns the old value, which equals expected on success.
+static inline uint
+cmpxchg(volatile uint *addr, uint expected, uint newval)
+{
+  uint result;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (expected) :
+               "cc", "memory");
+  return result;
+}
+
+// Enable interrupts and wait for one.  sti takes effect after
+// the next instruction, so an interrupt that is already pending
+// still wakes the hlt instead of being taken before it.
+static inline void
+sti_hlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {